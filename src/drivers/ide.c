@@ -1,21 +1,7 @@
 #include "ide.h"
 #include "common.h"
-
-// Forward declarations
-void printf(const char *fmt, ...);
-static inline uint8_t inb(uint16_t port);
-static inline void outb(uint16_t port, uint8_t value);
-static inline void io_wait(void);
-
-static inline uint8_t inb(uint16_t port) {
-    uint8_t value;
-    __asm__ __volatile__("inb %1, %0" : "=a"(value) : "Nd"(port));
-    return value;
-}
-
-static inline void outb(uint16_t port, uint8_t value) {
-    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
-}
+#include "kernel.h"
+#include "pci.h"
 
 static inline uint16_t inw(uint16_t port) {
     uint16_t value;
@@ -27,18 +13,192 @@ static inline void outw(uint16_t port, uint16_t value) {
     __asm__ __volatile__("outw %0, %1" : : "a"(value), "Nd"(port));
 }
 
-static inline void io_wait(void) {
-    outb(0x80, 0);
+static inline void insw(uint16_t port, void *buf, uint32_t count) {
+    __asm__ __volatile__("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void *buf, uint32_t count) {
+    __asm__ __volatile__("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
 }
 
+// Sectors transferred per DRQ block with READ/WRITE MULTIPLE (0 = unsupported)
+static uint32_t ide_multiple;
+
+// IRQ14 completion state; the issuing process sleeps on ide_wq
+static struct wait_queue ide_wq;
+static volatile bool ide_irq_fired;
+static volatile uint8_t ide_irq_status;
+static bool ide_use_irq;
+
+// Bus-master DMA state (base 0 = no PCI IDE controller, use PIO)
+static uint16_t ide_bm_base;
+static struct ide_prd ide_prd_table[IDE_PRD_MAX] __attribute__((aligned(IDE_PRD_MAX * 8)));
+
 static void ide_wait_bsy(void) {
     while (inb(IDE_PRIMARY_IO + IDE_REG_STATUS) & IDE_STATUS_BSY)
         ;
 }
 
-static void ide_wait_drq(void) {
-    while (!(inb(IDE_PRIMARY_IO + IDE_REG_STATUS) & IDE_STATUS_DRQ))
-        ;
+// Wait for the drive to request data; returns -1 if it reported an error
+static int ide_wait_drq(void) {
+    uint8_t status;
+    do {
+        status = inb(IDE_PRIMARY_IO + IDE_REG_STATUS);
+        if (status & IDE_STATUS_ERR)
+            return -1;
+    } while ((status & (IDE_STATUS_BSY | IDE_STATUS_DRQ)) != IDE_STATUS_DRQ);
+    return 0;
+}
+
+static void ide_irq(void) {
+    // Reading the status register acknowledges the interrupt
+    ide_irq_status = inb(IDE_PRIMARY_IO + IDE_REG_STATUS);
+    ide_irq_fired = true;
+    wake_up(&ide_wq);
+}
+
+// Wait for the drive to finish the current block and return its status.
+// With IRQ14 enabled the caller sleeps, letting other processes run.
+static uint8_t ide_wait_irq(void) {
+    if (!ide_use_irq) {
+        ide_wait_bsy();
+        return inb(IDE_PRIMARY_IO + IDE_REG_STATUS);
+    }
+
+    uint32_t flags = spin_lock_irqsave(&ide_wq.lock);
+    while (!ide_irq_fired)
+        sleep_on_locked(&ide_wq);
+    ide_irq_fired = false;
+    spin_unlock_irqrestore(&ide_wq.lock, flags);
+
+    return ide_irq_status;
+}
+
+// Select drive 0, program LBA + sector count and issue the command
+static void ide_issue(uint32_t lba, uint32_t count, uint8_t cmd) {
+    ide_wait_bsy();
+    ide_irq_fired = false;
+
+    // Select drive 0 and set LBA mode
+    outb(IDE_PRIMARY_IO + IDE_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    io_wait();
+
+    // Set sector count (0 means 256)
+    outb(IDE_PRIMARY_IO + IDE_REG_SECTOR_CNT, count & 0xFF);
+
+    // Set LBA
+    outb(IDE_PRIMARY_IO + IDE_REG_LBA_LOW, lba & 0xFF);
+    outb(IDE_PRIMARY_IO + IDE_REG_LBA_MID, (lba >> 8) & 0xFF);
+    outb(IDE_PRIMARY_IO + IDE_REG_LBA_HIGH, (lba >> 16) & 0xFF);
+
+    outb(IDE_PRIMARY_IO + IDE_REG_COMMAND, cmd);
+}
+
+// Read the 256-word IDENTIFY DEVICE block
+static bool ide_identify(uint16_t *id) {
+    outb(IDE_PRIMARY_IO + IDE_REG_DRIVE, 0xA0);
+    io_wait();
+    outb(IDE_PRIMARY_IO + IDE_REG_COMMAND, IDE_CMD_IDENTIFY);
+    io_wait();
+
+    if (inb(IDE_PRIMARY_IO + IDE_REG_STATUS) == 0 || ide_wait_drq() < 0)
+        return false;
+    insw(IDE_PRIMARY_IO + IDE_REG_DATA, id, 256);
+    return true;
+}
+
+// Ask the drive for its largest READ/WRITE MULTIPLE block and enable it
+static void ide_setup_multiple(const uint16_t *id) {
+    // Word 47 bits 0-7: max sectors per interrupt for the MULTIPLE commands
+    uint32_t max_multiple = id[47] & 0xFF;
+    if (max_multiple < 2)
+        return;
+
+    ide_issue(0, max_multiple, IDE_CMD_SET_MULTIPLE);
+    ide_wait_bsy();
+    if (inb(IDE_PRIMARY_IO + IDE_REG_STATUS) & IDE_STATUS_ERR)
+        return;
+
+    ide_multiple = max_multiple;
+}
+
+// Locate the PCI IDE controller (PIIX on QEMU) and its bus-master registers
+static void ide_setup_dma(const uint16_t *id) {
+    // Word 49 bit 8: DMA supported
+    if (!(id[49] & (1 << 8)))
+        return;
+
+    struct pci_device dev;
+    if (!pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &dev))
+        return;
+
+    // Prog IF bit 7: controller is bus-master capable; BAR4 is an I/O BAR
+    uint32_t bar4 = pci_read(&dev, PCI_REG_BAR4);
+    if (!(dev.prog_if & 0x80) || !(bar4 & 1))
+        return;
+
+    pci_enable_bus_master(&dev);
+    ide_bm_base = bar4 & 0xFFFC;
+    printf("IDE bus-master DMA at port %x (PCI %d:%d.%d)\n",
+           ide_bm_base, dev.bus, dev.slot, dev.func);
+}
+
+// Describe buf with PRD entries, splitting at 64KB boundaries.
+// Returns false if the buffer cannot be used for DMA.
+static bool ide_build_prdt(const void *buf, uint32_t bytes) {
+    paddr_t addr = (paddr_t) buf;  // Kernel memory is identity mapped
+    int n = 0;
+
+    if (addr & 1)
+        return false;
+
+    while (bytes > 0) {
+        if (n == IDE_PRD_MAX)
+            return false;
+
+        uint32_t boundary = (addr & ~0xFFFFu) + 0x10000;
+        uint32_t len = boundary - addr;
+        if (len > bytes)
+            len = bytes;
+
+        ide_prd_table[n].addr = addr;
+        ide_prd_table[n].count = len & 0xFFFF;  // 0 means 64KB
+        ide_prd_table[n].flags = 0;
+        addr += len;
+        bytes -= len;
+        n++;
+    }
+
+    ide_prd_table[n - 1].flags = IDE_PRD_EOT;
+    return true;
+}
+
+// One READ/WRITE DMA command: the controller moves every sector while
+// the issuing process sleeps until the completion interrupt
+static int ide_dma_transfer(uint32_t lba, uint32_t count, void *buf, bool is_write) {
+    if (!ide_build_prdt(buf, count * 512))
+        return 1;  // Caller falls back to PIO
+
+    outb(ide_bm_base + IDE_BM_COMMAND, 0);
+    __asm__ __volatile__("outl %0, %1" : : "a"((uint32_t) ide_prd_table),
+                         "Nd"((uint16_t) (ide_bm_base + IDE_BM_PRDT)));
+    outb(ide_bm_base + IDE_BM_STATUS,
+         inb(ide_bm_base + IDE_BM_STATUS) | IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+    outb(ide_bm_base + IDE_BM_COMMAND, is_write ? 0 : IDE_BM_CMD_READ);
+
+    ide_issue(lba, count, is_write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+    outb(ide_bm_base + IDE_BM_COMMAND,
+         (is_write ? 0 : IDE_BM_CMD_READ) | IDE_BM_CMD_START);
+
+    uint8_t status = ide_wait_irq();
+
+    outb(ide_bm_base + IDE_BM_COMMAND, 0);
+    uint8_t bm_status = inb(ide_bm_base + IDE_BM_STATUS);
+    outb(ide_bm_base + IDE_BM_STATUS, bm_status | IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+
+    if ((status & IDE_STATUS_ERR) || (bm_status & IDE_BM_STATUS_ERR))
+        return -1;
+    return 0;
 }
 
 void ide_init(void) {
@@ -59,66 +219,118 @@ void ide_init(void) {
     }
     
     printf("IDE drive detected and ready\n");
+
+    uint16_t id[256];
+    if (ide_identify(id)) {
+        ide_setup_multiple(id);
+        ide_setup_dma(id);
+    }
+    if (ide_multiple) {
+        printf("IDE multiple mode: %d sectors per block\n", ide_multiple);
+    }
+
+    // Clear nIEN so the drive raises IRQ14 on completion
+    outb(IDE_PRIMARY_CONTROL, 0x00);
+    irq_register(IRQ_IDE0, ide_irq);
+    irq_unmask(IRQ_IDE0);
+    ide_use_irq = true;
 }
 
-void ide_read_sector(uint32_t lba, void *buf) {
-    uint16_t *ptr = (uint16_t *)buf;
-    
-    ide_wait_bsy();
-    
-    // Select drive 0 and set LBA mode
-    outb(IDE_PRIMARY_IO + IDE_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
-    io_wait();
-    
-    // Set sector count
-    outb(IDE_PRIMARY_IO + IDE_REG_SECTOR_CNT, 1);
-    
-    // Set LBA
-    outb(IDE_PRIMARY_IO + IDE_REG_LBA_LOW, lba & 0xFF);
-    outb(IDE_PRIMARY_IO + IDE_REG_LBA_MID, (lba >> 8) & 0xFF);
-    outb(IDE_PRIMARY_IO + IDE_REG_LBA_HIGH, (lba >> 16) & 0xFF);
-    
-    // Send read command
-    outb(IDE_PRIMARY_IO + IDE_REG_COMMAND, IDE_CMD_READ_SECTORS);
-    
-    // Wait for data
-    ide_wait_drq();
-    
-    // Read 256 words (512 bytes)
-    for (int i = 0; i < 256; i++) {
-        ptr[i] = inw(IDE_PRIMARY_IO + IDE_REG_DATA);
+// Transfers only ever use kernel memory: user addresses are virtual, so
+// callers bounce user data through a kernel buffer
+static void ide_check_buffer(const void *buf, uint32_t count) {
+    if ((uint32_t) buf + count * 512 > USER_BASE)
+        PANIC("IDE transfer to non-kernel address %x", (uint32_t) buf);
+}
+
+// Read count sectors starting at lba; one command per 256 sectors
+int ide_read_sectors(uint32_t lba, uint32_t count, void *buf) {
+    uint8_t *ptr = (uint8_t *)buf;
+    ide_check_buffer(buf, count);
+
+    while (count > 0) {
+        uint32_t n = count < IDE_MAX_SECTORS_PER_CMD ? count : IDE_MAX_SECTORS_PER_CMD;
+        uint32_t block = ide_multiple ? ide_multiple : 1;
+
+        if (ide_bm_base && ide_use_irq) {
+            int ret = ide_dma_transfer(lba, n, ptr, false);
+            if (ret < 0)
+                return -1;
+            if (ret == 0) {
+                ptr += n * 512;
+                lba += n;
+                count -= n;
+                continue;
+            }
+        }
+
+        ide_issue(lba, n, ide_multiple ? IDE_CMD_READ_MULTIPLE : IDE_CMD_READ_SECTORS);
+
+        // One interrupt + DRQ handshake per block instead of per sector
+        for (uint32_t done = 0; done < n; done += block) {
+            uint32_t chunk = n - done < block ? n - done : block;
+            if ((ide_wait_irq() & IDE_STATUS_ERR) || ide_wait_drq() < 0)
+                return -1;
+            insw(IDE_PRIMARY_IO + IDE_REG_DATA, ptr, chunk * 256);
+            ptr += chunk * 512;
+        }
+
+        lba += n;
+        count -= n;
     }
+    return 0;
 }
 
-void ide_write_sector(uint32_t lba, const void *buf) {
-    const uint16_t *ptr = (const uint16_t *)buf;
-    
-    ide_wait_bsy();
-    
-    // Select drive 0 and set LBA mode
-    outb(IDE_PRIMARY_IO + IDE_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
-    io_wait();
-    
-    // Set sector count
-    outb(IDE_PRIMARY_IO + IDE_REG_SECTOR_CNT, 1);
-    
-    // Set LBA
-    outb(IDE_PRIMARY_IO + IDE_REG_LBA_LOW, lba & 0xFF);
-    outb(IDE_PRIMARY_IO + IDE_REG_LBA_MID, (lba >> 8) & 0xFF);
-    outb(IDE_PRIMARY_IO + IDE_REG_LBA_HIGH, (lba >> 16) & 0xFF);
-    
-    // Send write command
-    outb(IDE_PRIMARY_IO + IDE_REG_COMMAND, IDE_CMD_WRITE_SECTORS);
-    
-    // Wait for ready
-    ide_wait_drq();
-    
-    // Write 256 words (512 bytes)
-    for (int i = 0; i < 256; i++) {
-        outw(IDE_PRIMARY_IO + IDE_REG_DATA, ptr[i]);
+int ide_write_sectors(uint32_t lba, uint32_t count, const void *buf) {
+    const uint8_t *ptr = (const uint8_t *)buf;
+    ide_check_buffer(buf, count);
+
+    while (count > 0) {
+        uint32_t n = count < IDE_MAX_SECTORS_PER_CMD ? count : IDE_MAX_SECTORS_PER_CMD;
+        uint32_t block = ide_multiple ? ide_multiple : 1;
+
+        if (ide_bm_base && ide_use_irq) {
+            int ret = ide_dma_transfer(lba, n, (void *) ptr, true);
+            if (ret < 0)
+                return -1;
+            if (ret == 0) {
+                ptr += n * 512;
+                lba += n;
+                count -= n;
+                continue;
+            }
+        }
+
+        ide_issue(lba, n, ide_multiple ? IDE_CMD_WRITE_MULTIPLE : IDE_CMD_WRITE_SECTORS);
+
+        // The drive interrupts after accepting each block, the last
+        // one included
+        for (uint32_t done = 0; done < n; done += block) {
+            uint32_t chunk = n - done < block ? n - done : block;
+            if (ide_wait_drq() < 0)
+                return -1;
+            outsw(IDE_PRIMARY_IO + IDE_REG_DATA, ptr, chunk * 256);
+            ptr += chunk * 512;
+            if (ide_wait_irq() & IDE_STATUS_ERR)
+                return -1;
+        }
+
+        lba += n;
+        count -= n;
     }
-    
-    // Flush cache
-    ide_wait_bsy();
+    return 0;
+}
+
+int ide_read_sector(uint32_t lba, void *buf) {
+    return ide_read_sectors(lba, 1, buf);
 }
 
+int ide_write_sector(uint32_t lba, const void *buf) {
+    return ide_write_sectors(lba, 1, buf);
+}
+
+// Make everything the drive has accepted durable (drains its write cache)
+void ide_flush_cache(void) {
+    ide_issue(0, 0, IDE_CMD_FLUSH_CACHE);
+    ide_wait_irq();
+}
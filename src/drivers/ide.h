@@ -19,6 +19,16 @@
 // IDE commands
 #define IDE_CMD_READ_SECTORS  0x20
 #define IDE_CMD_WRITE_SECTORS 0x30
+#define IDE_CMD_READ_MULTIPLE 0xC4
+#define IDE_CMD_WRITE_MULTIPLE 0xC5
+#define IDE_CMD_SET_MULTIPLE  0xC6
+#define IDE_CMD_IDENTIFY      0xEC
+#define IDE_CMD_READ_DMA      0xC8
+#define IDE_CMD_WRITE_DMA     0xCA
+#define IDE_CMD_FLUSH_CACHE   0xE7
+
+// Largest transfer one command can describe (sector count register 0 = 256)
+#define IDE_MAX_SECTORS_PER_CMD 256
 
 // Status bits
 #define IDE_STATUS_BSY  0x80
@@ -26,7 +36,31 @@
 #define IDE_STATUS_DRQ  0x08
 #define IDE_STATUS_ERR  0x01
 
+// Bus-master IDE registers (offsets from PCI BAR4, primary channel)
+#define IDE_BM_COMMAND 0x00
+#define IDE_BM_STATUS  0x02
+#define IDE_BM_PRDT    0x04
+
+#define IDE_BM_CMD_START 0x01
+#define IDE_BM_CMD_READ  0x08   // Direction: device to memory
+
+#define IDE_BM_STATUS_ERR 0x02
+#define IDE_BM_STATUS_IRQ 0x04
+
+// Physical Region Descriptor: one contiguous piece of a DMA transfer
+#define IDE_PRD_MAX 8
+#define IDE_PRD_EOT 0x8000      // Last entry in the table
+
+struct ide_prd {
+    uint32_t addr;              // Physical buffer address
+    uint16_t count;             // Byte count, 0 = 64KB
+    uint16_t flags;
+} __attribute__((packed));
+
 void ide_init(void);
-void ide_read_sector(uint32_t lba, void *buf);
-void ide_write_sector(uint32_t lba, const void *buf);
+int ide_read_sector(uint32_t lba, void *buf);
+int ide_write_sector(uint32_t lba, const void *buf);
+int ide_read_sectors(uint32_t lba, uint32_t count, void *buf);
+int ide_write_sectors(uint32_t lba, uint32_t count, const void *buf);
+void ide_flush_cache(void);
 
@@ -0,0 +1,109 @@
+#include "pci.h"
+#include "common.h"
+#include "kernel.h"
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    __asm__ __volatile__("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t address = (1u << 31) | ((uint32_t) bus << 16) | ((uint32_t) slot << 11) |
+                       ((uint32_t) func << 8) | (offset & 0xFC);
+    outl(PCI_CONFIG_ADDRESS, address);
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read(const struct pci_device *dev, uint8_t offset) {
+    return pci_config_read(dev->bus, dev->slot, dev->func, offset);
+}
+
+void pci_write(const struct pci_device *dev, uint8_t offset, uint32_t value) {
+    uint32_t address = (1u << 31) | ((uint32_t) dev->bus << 16) | ((uint32_t) dev->slot << 11) |
+                       ((uint32_t) dev->func << 8) | (offset & 0xFC);
+    outl(PCI_CONFIG_ADDRESS, address);
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Fill dev from configuration space; returns false if no function is present
+static bool pci_probe(uint8_t bus, uint8_t slot, uint8_t func, struct pci_device *dev) {
+    uint32_t id = pci_config_read(bus, slot, func, PCI_REG_VENDOR_ID);
+    if ((id & 0xFFFF) == 0xFFFF)
+        return false;
+
+    uint32_t class_reg = pci_config_read(bus, slot, func, PCI_REG_CLASS);
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor_id = id & 0xFFFF;
+    dev->device_id = id >> 16;
+    dev->class_code = class_reg >> 24;
+    dev->subclass = (class_reg >> 16) & 0xFF;
+    dev->prog_if = (class_reg >> 8) & 0xFF;
+    return true;
+}
+
+// Walk every bus/slot/function, calling fn until it returns true
+static bool pci_scan(bool (*fn)(const struct pci_device *dev, void *arg), void *arg) {
+    struct pci_device dev;
+
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            if (!pci_probe(bus, slot, 0, &dev))
+                continue;
+
+            // Only multi-function devices have functions 1-7
+            bool multi = pci_config_read(bus, slot, 0, PCI_REG_HEADER) & (0x80 << 16);
+            int funcs = multi ? 8 : 1;
+            for (int func = 0; func < funcs; func++) {
+                if (func > 0 && !pci_probe(bus, slot, func, &dev))
+                    continue;
+                if (fn(&dev, arg))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+struct pci_class_match {
+    uint8_t class_code;
+    uint8_t subclass;
+    struct pci_device *out;
+};
+
+static bool match_class(const struct pci_device *dev, void *arg) {
+    struct pci_class_match *m = arg;
+    if (dev->class_code != m->class_code || dev->subclass != m->subclass)
+        return false;
+    *m->out = *dev;
+    return true;
+}
+
+bool pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *out) {
+    struct pci_class_match m = { class_code, subclass, out };
+    return pci_scan(match_class, &m);
+}
+
+void pci_enable_bus_master(const struct pci_device *dev) {
+    uint32_t cmd = pci_read(dev, PCI_REG_COMMAND);
+    pci_write(dev, PCI_REG_COMMAND, (cmd & 0xFFFF) | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+}
+
+static bool print_device(const struct pci_device *dev, void *arg) {
+    (void) arg;
+    printf("  %d:%d.%d  vendor %x device %x  class %d subclass %d\n",
+           dev->bus, dev->slot, dev->func, dev->vendor_id, dev->device_id,
+           dev->class_code, dev->subclass);
+    return false;
+}
+
+void pci_list(void) {
+    printf("PCI devices:\n");
+    pci_scan(print_device, NULL);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "common.h"
+
+// PCI configuration space access (mechanism #1)
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration header offsets
+#define PCI_REG_VENDOR_ID  0x00
+#define PCI_REG_COMMAND    0x04
+#define PCI_REG_CLASS      0x08   // Revision, prog IF, subclass, class
+#define PCI_REG_HEADER     0x0C   // Header type in bits 16-23
+#define PCI_REG_BAR0       0x10
+#define PCI_REG_BAR4       0x20
+
+// Command register bits
+#define PCI_CMD_IO          0x0001
+#define PCI_CMD_MEMORY      0x0002
+#define PCI_CMD_BUS_MASTER  0x0004
+
+// Class codes
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+};
+
+uint32_t pci_read(const struct pci_device *dev, uint8_t offset);
+void pci_write(const struct pci_device *dev, uint8_t offset, uint32_t value);
+bool pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *out);
+void pci_enable_bus_master(const struct pci_device *dev);
+void pci_list(void);
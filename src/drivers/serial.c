@@ -0,0 +1,154 @@
+#include "serial.h"
+#include "common.h"
+#include "kernel.h"
+
+// Single-producer, single-consumer byte queue. Each index only ever
+// moves forward and is written by one side, so the two sides need no
+// lock between them.
+struct ring {
+    volatile uint32_t head;      // Next write; producer only
+    volatile uint32_t tail;      // Next read; consumer only
+    uint8_t buf[SERIAL_RING_SIZE];
+};
+
+// Transmit: console writes produce under the console lock; the IRQ handler or
+// a kick from putchar() consumes under tx_lock. Receive: the IRQ handler
+// produces; readers consume under rx_lock.
+static struct ring tx_ring, rx_ring;
+static struct spinlock tx_lock, rx_lock;
+static struct wait_queue rx_wq;   // Waiting for rx_ring to be non-empty
+static bool irq_enabled;
+
+static inline bool ring_empty(const struct ring *r) {
+    return r->head == r->tail;
+}
+
+static inline bool ring_full(const struct ring *r) {
+    return r->head - r->tail == SERIAL_RING_SIZE;
+}
+
+// The full barrier of a sequentially consistent store orders the index
+// update before the caller looks at the other side's index
+static inline void ring_push(struct ring *r, uint8_t byte) {
+    r->buf[r->head % SERIAL_RING_SIZE] = byte;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+}
+
+static inline uint8_t ring_pop(struct ring *r) {
+    uint8_t byte = r->buf[r->tail % SERIAL_RING_SIZE];
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    return byte;
+}
+
+static inline uint8_t uart_read(uint32_t reg) {
+    return inb(PORT_COM1 + reg);
+}
+
+static inline void uart_write(uint32_t reg, uint8_t value) {
+    outb(PORT_COM1 + reg, value);
+}
+
+void serial_init(void) {
+    uart_write(UART_IER, 0);
+    uart_write(UART_LCR, UART_LCR_DLAB);
+    uart_write(UART_DATA, UART_DIVISOR & 0xFF);
+    uart_write(UART_IER, UART_DIVISOR >> 8);
+    uart_write(UART_LCR, UART_LCR_8N1);
+    uart_write(UART_FCR, UART_FCR_ENABLE);
+    uart_write(UART_MCR, UART_MCR_DTR_RTS | UART_MCR_OUT2);
+}
+
+// Refill the transmit FIFO if it has drained. Once the bytes written here
+// have gone out, the UART interrupts again for more.
+static void tx_drain(void) {
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    if (uart_read(UART_LSR) & UART_LSR_THRE) {
+        for (int n = 0; n < UART_FIFO_SIZE && !ring_empty(&tx_ring); n++)
+            uart_write(UART_DATA, ring_pop(&tx_ring));
+    }
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+// Send everything queued, without relying on interrupts (e.g. on panic)
+void serial_flush(void) {
+    while (!ring_empty(&tx_ring))
+        tx_drain();
+}
+
+static void serial_irq(void) {
+    bool received = false;
+    while (!(uart_read(UART_IIR) & UART_IIR_NONE)) {
+        while (uart_read(UART_LSR) & UART_LSR_DR) {
+            uint8_t byte = uart_read(UART_DATA);
+            if (!ring_full(&rx_ring))
+                ring_push(&rx_ring, byte);   // Dropped if no one is reading
+            received = true;
+        }
+        tx_drain();
+    }
+    if (received)
+        wake_up(&rx_wq);
+}
+
+// Call once interrupts are set up. Enabling the transmit interrupt raises
+// it at once if the FIFO is empty, which sends anything queued during boot.
+void serial_enable_irq(void) {
+    irq_register(IRQ_COM1, serial_irq);
+    irq_unmask(IRQ_COM1);
+    uart_write(UART_IER, UART_IER_RX | UART_IER_TX);
+    irq_enabled = true;
+}
+
+// Queue n bytes for sending. Each run that fits is copied in with at most
+// two memcpy()s and published with one index store. The UART interrupts
+// when it has sent what it was given, so only a run the IRQ handler may
+// have missed needs a kick: one that found every earlier byte already
+// taken. If the ring is full (say, interrupts are off), push bytes out by
+// hand until there is room. Until the IRQ is enabled, everything is sent
+// before returning. The caller serializes producers.
+void serial_write(const char *s, size_t n) {
+    while (n > 0) {
+        while (ring_full(&tx_ring))
+            tx_drain();
+
+        uint32_t pos = tx_ring.head;
+        uint32_t room = SERIAL_RING_SIZE - (pos - tx_ring.tail);
+        uint32_t count = n < room ? n : room;
+        uint32_t at = pos % SERIAL_RING_SIZE;
+        uint32_t first = SERIAL_RING_SIZE - at;
+        if (first > count)
+            first = count;
+        memcpy(&tx_ring.buf[at], s, first);
+        memcpy(tx_ring.buf, s + first, count - first);
+        __atomic_store_n(&tx_ring.head, pos + count, __ATOMIC_SEQ_CST);
+
+        if (tx_ring.tail == pos)
+            tx_drain();
+        s += count;
+        n -= count;
+    }
+    if (!irq_enabled)
+        serial_flush();
+}
+
+void serial_putc(char ch) {
+    serial_write(&ch, 1);
+}
+
+// Next received byte, or -1 if there is none
+long serial_getc(void) {
+    long ch = -1;
+    uint32_t flags = spin_lock_irqsave(&rx_lock);
+    if (!ring_empty(&rx_ring))
+        ch = ring_pop(&rx_ring);
+    spin_unlock_irqrestore(&rx_lock, flags);
+    return ch;
+}
+
+// Block until a received byte is waiting
+void serial_wait_input(void) {
+    uint32_t flags = spin_lock_irqsave(&rx_wq.lock);
+    while (ring_empty(&rx_ring))
+        sleep_on_locked(&rx_wq);
+    spin_unlock_irqrestore(&rx_wq.lock, flags);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "common.h"
+
+// 16550 UART on COM1, interrupt driven. Output is queued in a transmit
+// ring that the IRQ handler feeds to the UART's FIFO; received bytes are
+// queued in a receive ring by the IRQ handler.
+
+#define PORT_COM1 0x3f8
+#define IRQ_COM1  4
+
+// Register offsets
+#define UART_DATA 0          // RBR (read) / THR (write); divisor low with DLAB
+#define UART_IER  1          // Interrupt enable; divisor high with DLAB
+#define UART_IIR  2          // Interrupt identification (read)
+#define UART_FCR  2          // FIFO control (write)
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define UART_IER_RX        0x01
+#define UART_IER_TX        0x02   // Transmit holding register empty
+#define UART_IIR_NONE      0x01   // No interrupt pending
+#define UART_LCR_8N1       0x03
+#define UART_LCR_DLAB      0x80
+#define UART_FCR_ENABLE    0xC7   // Enable and clear FIFOs, 14-byte RX trigger
+#define UART_MCR_DTR_RTS   0x03
+#define UART_MCR_OUT2      0x08   // Gates the IRQ line on PCs
+#define UART_LSR_DR        0x01   // Data ready
+#define UART_LSR_THRE      0x20   // Transmit FIFO empty
+
+#define UART_FIFO_SIZE     16
+#define UART_DIVISOR       3      // 38400 baud
+
+#define SERIAL_RING_SIZE   4096   // Bytes, power of two
+
+void serial_init(void);
+void serial_enable_irq(void);
+void serial_putc(char ch);
+void serial_write(const char *s, size_t n);
+long serial_getc(void);
+void serial_wait_input(void);
+void serial_flush(void);
@@ -0,0 +1,121 @@
+#include "timer.h"
+#include "common.h"
+#include "kernel.h"
+#include "apic.h"
+
+#define CALIBRATE_MS 10
+#define MS_PER_TICK  (1000 / HZ)
+
+volatile uint32_t timer_ticks;
+static uint32_t tsc_khz;               // TSC cycles per millisecond (0 = unknown)
+static uint64_t tsc_base;
+static uint32_t lapic_count;           // LAPIC timer count per tick (0 = PIT drives the tick)
+static struct wait_queue sleep_wq;     // Processes in timer_sleep()
+
+// Busy-wait us microseconds (at most 54000) on PIT channel 2. It counts
+// down once; its output, bit 5 of port 0x61, goes high at zero.
+void timer_udelay(uint32_t us) {
+    uint32_t count = PIT_FREQUENCY / 1000 * us / 1000;
+    if (count == 0)
+        count = 1;
+    outb(PIT_GATE_PORT, inb(PIT_GATE_PORT) & ~0x03);  // Gate off, speaker off
+    outb(PIT_COMMAND, 0xB0);                          // Channel 2, lo/hi byte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+    outb(PIT_GATE_PORT, inb(PIT_GATE_PORT) | 0x01);   // Gate on: start counting
+    while (!(inb(PIT_GATE_PORT) & 0x20))
+        ;
+}
+
+// Measure the TSC and, if there is one, the local APIC timer against the PIT
+static void calibrate(void) {
+    if (lapic_available()) {
+        lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+    }
+
+    uint64_t tsc_start = rdtsc();
+    timer_udelay(CALIBRATE_MS * 1000);
+    uint32_t cycles = rdtsc() - tsc_start;
+
+    if (lapic_available()) {
+        uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_COUNT);
+        lapic_write(LAPIC_REG_TIMER_INIT, 0);
+        lapic_count = elapsed * MS_PER_TICK / CALIBRATE_MS;
+    }
+    tsc_khz = cycles / CALIBRATE_MS;
+}
+
+static void lapic_timer_start(void) {
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_LVT_PERIODIC);
+    lapic_write(LAPIC_REG_TIMER_INIT, lapic_count);
+}
+
+// Start the periodic tick. Call with interrupts disabled, after lapic_init().
+void timer_init(void) {
+    calibrate();
+    tsc_base = rdtsc();
+
+    if (lapic_count) {
+        lapic_timer_start();
+    } else {
+        uint32_t divisor = PIT_FREQUENCY / HZ;
+        outb(PIT_COMMAND, 0x34);                      // Channel 0, lo/hi byte, mode 2
+        outb(PIT_CHANNEL0, divisor & 0xFF);
+        outb(PIT_CHANNEL0, divisor >> 8);
+        irq_register(IRQ_PIT, timer_tick);
+        irq_unmask(IRQ_PIT);
+    }
+}
+
+// Start an application processor's tick. All local APIC timers run at the
+// rate the boot CPU measured.
+void timer_init_ap(void) {
+    if (lapic_count)
+        lapic_timer_start();
+}
+
+// Timer interrupt, on every CPU. The boot CPU also advances the clock and
+// wakes sleepers that are due. Each CPU charges the tick to whatever it
+// is running.
+void timer_tick(void) {
+    if (this_cpu()->id == 0) {
+        timer_ticks++;
+
+        bool due = false;
+        uint32_t flags = spin_lock_irqsave(&sleep_wq.lock);
+        for (struct process *proc = sleep_wq.head; proc && !due; proc = proc->wait_next)
+            due = (int32_t) (timer_ticks - proc->wake_tick) >= 0;
+        spin_unlock_irqrestore(&sleep_wq.lock, flags);
+        if (due)
+            wake_up(&sleep_wq);   // The rest go back to sleep
+    }
+    scheduler_tick();
+}
+
+// Monotonic time since timer_init() in microseconds, from the TSC. Falls
+// back to tick resolution if the TSC could not be calibrated.
+uint64_t clock_us(void) {
+    if (!tsc_khz)
+        return (uint64_t) timer_ticks * MS_PER_TICK * 1000;
+    return udiv64((rdtsc() - tsc_base) * 1000, tsc_khz, NULL);
+}
+
+// Block the current process for at least ms milliseconds
+void timer_sleep(uint32_t ms) {
+    // The current tick is already partly over, so wait one more
+    uint32_t wake = timer_ticks + (ms + MS_PER_TICK - 1) / MS_PER_TICK + 1;
+
+    current_proc->wake_tick = wake;
+    while ((int32_t) (timer_ticks - wake) < 0)
+        sleep_on(&sleep_wq);
+}
+
+void timer_print_info(void) {
+    uint32_t ms = udiv64(clock_us(), 1000, NULL);
+    printf("Uptime: %d ms (%d ticks at %d Hz from the %s)\n", ms, timer_ticks, HZ,
+           lapic_count ? "local APIC timer" : "PIT");
+    if (tsc_khz)
+        printf("  TSC: %d kHz\n", tsc_khz);
+}
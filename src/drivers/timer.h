@@ -0,0 +1,26 @@
+#pragma once
+#include "common.h"
+
+// System timer: a periodic tick from the local APIC timer, or from the
+// PIT when there is no local APIC, plus a TSC-based monotonic clock
+
+#define HZ 100                     // Timer ticks per second
+#define TIME_SLICE_TICKS 2         // Ticks a process runs before being preempted
+
+// 8253/8254 programmable interval timer
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL0  0x40
+#define PIT_CHANNEL2  0x42
+#define PIT_COMMAND   0x43
+#define PIT_GATE_PORT 0x61         // Channel 2 gate (bit 0) and output (bit 5)
+#define IRQ_PIT       0
+
+extern volatile uint32_t timer_ticks;
+
+void timer_init(void);
+void timer_init_ap(void);
+void timer_udelay(uint32_t us);
+void timer_tick(void);
+uint64_t clock_us(void);
+void timer_sleep(uint32_t ms);
+void timer_print_info(void);
@@ -1,39 +1,100 @@
+#include "vga.h"
 #include "common.h"
+#include "kernel.h"
 
 // VGA text mode buffer at 0xB8000
 #define VGA_MEMORY 0xB8000
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define VGA_COLOR 0x0F  // White on black
+#define VGA_BLANK ((VGA_COLOR << 8) | ' ')
+
+// The 32KB text window holds far more rows than the screen shows. Output
+// runs down a ring of them and the CRTC start address follows, so a
+// scroll costs one row to clear instead of a copy of the whole screen.
+#define VGA_MEMORY_CELLS (32 * 1024 / 2)
+#define VGA_RING_ROWS (VGA_MEMORY_CELLS / VGA_WIDTH)
+
+// CRTC registers
+#define VGA_CRTC_INDEX 0x3D4
+#define VGA_CRTC_DATA 0x3D5
+#define CRTC_CURSOR_START 0x0A
+#define CRTC_CURSOR_END 0x0B
+#define CRTC_START_HIGH 0x0C
+#define CRTC_START_LOW 0x0D
+#define CRTC_CURSOR_HIGH 0x0E
+#define CRTC_CURSOR_LOW 0x0F
 
 static uint16_t *vga_buffer = (uint16_t *)VGA_MEMORY;
 static int vga_col = 0;
-static int vga_row = 0;
+static int vga_row = 0;   // On screen
+static int vga_top = 0;   // Ring row shown at the top of the screen
+
+static void crtc_write(uint8_t reg, uint8_t value) {
+    outb(VGA_CRTC_INDEX, reg);
+    outb(VGA_CRTC_DATA, value);
+}
+
+static uint8_t crtc_read(uint8_t reg) {
+    outb(VGA_CRTC_INDEX, reg);
+    return inb(VGA_CRTC_DATA);
+}
+
+static inline uint16_t *vga_cell(int row, int col) {
+    return &vga_buffer[(vga_top + row) * VGA_WIDTH + col];
+}
+
+static void vga_clear_row(int row) {
+    uint16_t *cell = vga_cell(row, 0);
+    for (int col = 0; col < VGA_WIDTH; col++) {
+        cell[col] = VGA_BLANK;
+    }
+}
+
+static void vga_set_start(void) {
+    uint16_t start = vga_top * VGA_WIDTH;
+    crtc_write(CRTC_START_HIGH, start >> 8);
+    crtc_write(CRTC_START_LOW, start & 0xFF);
+}
+
+// The hardware cursor is only moved once per write, not per character
+static void vga_update_cursor(void) {
+    uint16_t pos = (vga_top + vga_row) * VGA_WIDTH + vga_col;
+    crtc_write(CRTC_CURSOR_HIGH, pos >> 8);
+    crtc_write(CRTC_CURSOR_LOW, pos & 0xFF);
+}
 
 void vga_init(void) {
     // Clear screen
-    for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-        vga_buffer[i] = (VGA_COLOR << 8) | ' ';
+    vga_top = 0;
+    for (int row = 0; row < VGA_HEIGHT; row++) {
+        vga_clear_row(row);
     }
     vga_col = 0;
     vga_row = 0;
+    vga_set_start();
+
+    // Underline cursor on the last two scan lines
+    crtc_write(CRTC_CURSOR_START, (crtc_read(CRTC_CURSOR_START) & 0xC0) | 14);
+    crtc_write(CRTC_CURSOR_END, (crtc_read(CRTC_CURSOR_END) & 0xE0) | 15);
+    vga_update_cursor();
 }
 
+// Move the screen down a row. Only when the ring runs out are the rows
+// still on screen copied back to its start, once every ~180 lines.
 static void vga_scroll(void) {
-    // Move all rows up
-    for (int row = 0; row < VGA_HEIGHT - 1; row++) {
-        for (int col = 0; col < VGA_WIDTH; col++) {
-            vga_buffer[row * VGA_WIDTH + col] = vga_buffer[(row + 1) * VGA_WIDTH + col];
-        }
-    }
-    // Clear last row
-    for (int col = 0; col < VGA_WIDTH; col++) {
-        vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + col] = (VGA_COLOR << 8) | ' ';
+    if (vga_top + VGA_HEIGHT == VGA_RING_ROWS) {
+        memcpy(vga_buffer, vga_cell(1, 0), (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
+        vga_top = 0;
+    } else {
+        vga_top++;
     }
+    vga_clear_row(VGA_HEIGHT - 1);
+    vga_set_start();
     vga_row = VGA_HEIGHT - 1;
 }
 
-void vga_putchar(char ch) {
+static void vga_put(char ch) {
     if (ch == '\n') {
         vga_col = 0;
         vga_row++;
@@ -45,10 +106,10 @@ void vga_putchar(char ch) {
     } else if (ch == '\b') {
         if (vga_col > 0) {
             vga_col--;
-            vga_buffer[vga_row * VGA_WIDTH + vga_col] = (VGA_COLOR << 8) | ' ';
+            *vga_cell(vga_row, vga_col) = VGA_BLANK;
         }
     } else {
-        vga_buffer[vga_row * VGA_WIDTH + vga_col] = (VGA_COLOR << 8) | ch;
+        *vga_cell(vga_row, vga_col) = (VGA_COLOR << 8) | (uint8_t) ch;
         vga_col++;
         if (vga_col >= VGA_WIDTH) {
             vga_col = 0;
@@ -60,9 +121,21 @@ void vga_putchar(char ch) {
     }
 }
 
+void vga_putchar(char ch) {
+    vga_put(ch);
+    vga_update_cursor();
+}
+
+void vga_write(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        vga_put(s[i]);
+    }
+    vga_update_cursor();
+}
+
 void vga_puts(const char *str) {
     while (*str) {
-        vga_putchar(*str++);
+        vga_put(*str++);
     }
+    vga_update_cursor();
 }
-
@@ -1,6 +1,8 @@
 #pragma once
+#include "common.h"
 
 void vga_init(void);
 void vga_putchar(char ch);
+void vga_write(const char *s, size_t n);
 void vga_puts(const char *str);
 
@@ -0,0 +1,287 @@
+#include "bcache.h"
+#include "common.h"
+#include "ide.h"
+
+// Forward declarations
+void printf(const char *fmt, ...);
+
+static struct bcache_buf bufs[BCACHE_NBUF];
+static struct bcache_buf *hash_table[BCACHE_HASH_SIZE];
+static struct bcache_buf lru;     // Sentinel: lru.lru_next is the MRU buffer
+static struct bcache_stats stats;
+static uint8_t staging[BCACHE_RANGE_MAX * BCACHE_SECTOR_SIZE];  // For coalesced writeback
+
+static inline uint32_t bcache_hash(uint32_t lba) {
+    return lba % BCACHE_HASH_SIZE;
+}
+
+static void lru_unlink(struct bcache_buf *b) {
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
+}
+
+// Move buffer to the most recently used position
+static void lru_touch(struct bcache_buf *b) {
+    lru_unlink(b);
+    b->lru_next = lru.lru_next;
+    b->lru_prev = &lru;
+    lru.lru_next->lru_prev = b;
+    lru.lru_next = b;
+}
+
+static void hash_remove(struct bcache_buf *b) {
+    struct bcache_buf **pp = &hash_table[bcache_hash(b->lba)];
+    while (*pp) {
+        if (*pp == b) {
+            *pp = b->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+static void hash_insert(struct bcache_buf *b) {
+    uint32_t h = bcache_hash(b->lba);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+}
+
+static struct bcache_buf *lookup(uint32_t lba) {
+    for (struct bcache_buf *b = hash_table[bcache_hash(lba)]; b; b = b->hash_next) {
+        if (b->valid && b->lba == lba) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Returns -1 if the drive reports an error; the buffer then stays dirty
+static int writeback(struct bcache_buf *b) {
+    if (ide_write_sector(b->lba, b->data) < 0) {
+        return -1;
+    }
+    b->dirty = false;
+    stats.writebacks++;
+    return 0;
+}
+
+// Take the least recently used buffer that can be reused and rebind it to
+// lba. A dirty buffer whose writeback fails keeps its data and is skipped.
+// Returns NULL if no buffer could be freed.
+static struct bcache_buf *evict(uint32_t lba) {
+    for (struct bcache_buf *b = lru.lru_prev; b != &lru; b = b->lru_prev) {
+        if (b->valid) {
+            if (b->dirty && writeback(b) < 0) {
+                continue;
+            }
+            hash_remove(b);
+        }
+
+        b->lba = lba;
+        b->valid = true;
+        b->dirty = false;
+        hash_insert(b);
+        return b;
+    }
+    return NULL;
+}
+
+// Undo evict() for a buffer that never got its data
+static void invalidate(struct bcache_buf *b) {
+    hash_remove(b);
+    b->valid = false;
+}
+
+void bcache_init(void) {
+    memset(bufs, 0, sizeof(bufs));
+    memset(hash_table, 0, sizeof(hash_table));
+    memset(&stats, 0, sizeof(stats));
+
+    lru.lru_next = &lru;
+    lru.lru_prev = &lru;
+    for (int i = 0; i < BCACHE_NBUF; i++) {
+        bufs[i].lru_next = &lru;
+        bufs[i].lru_prev = lru.lru_prev;
+        lru.lru_prev->lru_next = &bufs[i];
+        lru.lru_prev = &bufs[i];
+    }
+}
+
+// Returns -1 if the sector can't be read; nothing is cached for it then
+int bcache_read(uint32_t lba, void *buf) {
+    struct bcache_buf *b = lookup(lba);
+    if (b) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        b = evict(lba);
+        if (!b) {
+            return -1;
+        }
+        if (ide_read_sector(lba, b->data) < 0) {
+            invalidate(b);
+            return -1;
+        }
+    }
+
+    lru_touch(b);
+    memcpy(buf, b->data, BCACHE_SECTOR_SIZE);
+    return 0;
+}
+
+// Whole-sector write: no need to read the old contents on a miss. Returns
+// -1 if no buffer can be freed for it.
+int bcache_write(uint32_t lba, const void *buf) {
+    struct bcache_buf *b = lookup(lba);
+    if (b) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        b = evict(lba);
+        if (!b) {
+            return -1;
+        }
+    }
+
+    memcpy(b->data, buf, BCACHE_SECTOR_SIZE);
+    b->dirty = true;
+    lru_touch(b);
+    return 0;
+}
+
+// Read count sectors. Cached sectors are copied out; each run of uncached
+// sectors is fetched with a single multi-sector command straight into buf.
+// Returns -1 if the drive reports an error; nothing failed is cached.
+int bcache_read_range(uint32_t lba, uint32_t count, void *buf) {
+    uint8_t *dst = (uint8_t *) buf;
+    bool cache_fill = count <= BCACHE_RANGE_MAX;
+    uint32_t i = 0;
+
+    while (i < count) {
+        struct bcache_buf *b = lookup(lba + i);
+        if (b) {
+            stats.hits++;
+            lru_touch(b);
+            memcpy(dst + i * BCACHE_SECTOR_SIZE, b->data, BCACHE_SECTOR_SIZE);
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (i + run < count && !lookup(lba + i + run)) {
+            run++;
+        }
+
+        stats.misses += run;
+        if (ide_read_sectors(lba + i, run, dst + i * BCACHE_SECTOR_SIZE) < 0) {
+            return -1;
+        }
+
+        if (cache_fill) {
+            for (uint32_t j = i; j < i + run; j++) {
+                b = evict(lba + j);
+                if (!b) {
+                    break;  // The data is in buf anyway
+                }
+                memcpy(b->data, dst + j * BCACHE_SECTOR_SIZE, BCACHE_SECTOR_SIZE);
+                lru_touch(b);
+            }
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Short ranges are absorbed by the cache; long ones are written through
+// with one command and any cached copies refreshed. Returns -1 if the
+// drive reports an error, leaving cached copies as they were.
+int bcache_write_range(uint32_t lba, uint32_t count, const void *buf) {
+    const uint8_t *src = (const uint8_t *) buf;
+
+    if (count <= BCACHE_RANGE_MAX) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (bcache_write(lba + i, src + i * BCACHE_SECTOR_SIZE) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (ide_write_sectors(lba, count, buf) < 0) {
+        return -1;
+    }
+    stats.writebacks += count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct bcache_buf *b = lookup(lba + i);
+        if (b) {
+            memcpy(b->data, src + i * BCACHE_SECTOR_SIZE, BCACHE_SECTOR_SIZE);
+            b->dirty = false;
+        }
+    }
+    return 0;
+}
+
+// Write every dirty buffer back to disk, in LBA order, merging
+// neighbouring sectors into multi-sector writes. Returns -1 if any write
+// failed; those buffers stay dirty.
+int bcache_sync(void) {
+    struct bcache_buf *dirty[BCACHE_NBUF];
+    int n = 0;
+
+    for (int i = 0; i < BCACHE_NBUF; i++) {
+        if (bufs[i].valid && bufs[i].dirty) {
+            // Insertion sort by LBA
+            int j = n++;
+            while (j > 0 && dirty[j - 1]->lba > bufs[i].lba) {
+                dirty[j] = dirty[j - 1];
+                j--;
+            }
+            dirty[j] = &bufs[i];
+        }
+    }
+
+    int ret = 0;
+    int i = 0;
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && run < BCACHE_RANGE_MAX &&
+               dirty[i + run]->lba == dirty[i]->lba + run) {
+            run++;
+        }
+
+        if (run == 1) {
+            if (writeback(dirty[i]) < 0) {
+                ret = -1;
+            }
+        } else {
+            for (int j = 0; j < run; j++) {
+                memcpy(staging + j * BCACHE_SECTOR_SIZE, dirty[i + j]->data, BCACHE_SECTOR_SIZE);
+            }
+            if (ide_write_sectors(dirty[i]->lba, run, staging) < 0) {
+                ret = -1;
+            } else {
+                for (int j = 0; j < run; j++) {
+                    dirty[i + j]->dirty = false;
+                }
+                stats.writebacks += run;
+            }
+        }
+        i += run;
+    }
+    return ret;
+}
+
+void bcache_print_stats(void) {
+    int dirty = 0;
+    for (int i = 0; i < BCACHE_NBUF; i++) {
+        if (bufs[i].valid && bufs[i].dirty) {
+            dirty++;
+        }
+    }
+
+    printf("Buffer cache: %d buffers, %d dirty\n", BCACHE_NBUF, dirty);
+    printf("  Hits: %d  Misses: %d  Writebacks: %d\n",
+           stats.hits, stats.misses, stats.writebacks);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "common.h"
+
+// Write-back sector buffer cache sitting between SimpleFS and the IDE driver
+
+#define BCACHE_SECTOR_SIZE 512
+#define BCACHE_NBUF        64   // Number of cached sectors (32KB)
+#define BCACHE_HASH_SIZE   32   // Hash buckets, indexed by LBA
+#define BCACHE_RANGE_MAX   16   // Longer ranged transfers bypass the cache
+
+struct bcache_buf {
+    uint32_t lba;                    // Sector number held by this buffer
+    bool valid;                      // Buffer contains data for lba
+    bool dirty;                      // Buffer must be written back before reuse
+    struct bcache_buf *hash_next;    // Next buffer in the same hash bucket
+    struct bcache_buf *lru_prev;     // Towards most recently used
+    struct bcache_buf *lru_next;     // Towards least recently used
+    uint8_t data[BCACHE_SECTOR_SIZE];
+};
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+};
+
+void bcache_init(void);
+int bcache_read(uint32_t lba, void *buf);
+int bcache_write(uint32_t lba, const void *buf);
+int bcache_read_range(uint32_t lba, uint32_t count, void *buf);
+int bcache_write_range(uint32_t lba, uint32_t count, const void *buf);
+int bcache_sync(void);
+void bcache_print_stats(void);
@@ -2,89 +2,742 @@
 #include "common.h"
 
 // Forward declarations
-void read_write_disk(void *buf, unsigned sector, int is_write);
+int read_write_disk(void *buf, unsigned sector, int is_write);
+int read_write_disk_range(void *buf, unsigned sector, unsigned count, int is_write);
+int flush_disk(void);
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+void fs_lock(void);
+void fs_unlock(void);
+int current_pid(void);
+void page_cache_invalidate(int ino);
+void page_cache_update(int ino, uint32_t off, const void *buf, size_t len);
 void putchar(char ch);
 void printf(const char *fmt, ...);
 
 struct simplefs_state fs;
 
-// Find a free inode
-static struct simplefs_inode *find_free_inode(void) {
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i++) {
-        if (!fs.inodes[i].in_use) {
-            return &fs.inodes[i];
+_Static_assert(sizeof(fs.inodes) % SIMPLEFS_BLOCK_SIZE == 0,
+               "inode table must fill whole sectors");
+
+_Static_assert(sizeof(struct simplefs_inode) == 128,
+               "inodes must pack evenly into sectors");
+
+_Static_assert(sizeof(fs.bitmap) == SIMPLEFS_BITMAP_BLOCKS * SIMPLEFS_BLOCK_SIZE,
+               "bitmap must fill whole sectors");
+
+_Static_assert(SIMPLEFS_JOURNAL_TXN_MAX + 2 <= SIMPLEFS_JOURNAL_BLOCKS - 1,
+               "largest transaction must fit in the journal log");
+
+_Static_assert(SIMPLEFS_JOURNAL_TXN_MAX <= sizeof(((struct simplefs_journal_desc *) 0)->lba) / 4,
+               "descriptor must name every block of a transaction");
+
+// Descriptor + blocks of the transaction being committed or replayed
+static uint8_t journal_buf[(SIMPLEFS_JOURNAL_TXN_MAX + 1) * SIMPLEFS_BLOCK_SIZE];
+
+// The inode table is stored contiguously and moved in one request
+static int read_inode_table(void) {
+    return read_write_disk_range(fs.inodes, fs.sb.inode_start, sizeof(fs.inodes) / SIMPLEFS_BLOCK_SIZE, 0);
+}
+
+static int write_inode_table(void) {
+    return read_write_disk_range(fs.inodes, fs.sb.inode_start, sizeof(fs.inodes) / SIMPLEFS_BLOCK_SIZE, 1);
+}
+
+static void write_superblock(void) {
+    read_write_disk(&fs.sb, 0, 1);
+}
+
+static int write_bitmap(void) {
+    return read_write_disk_range(fs.bitmap, fs.sb.bitmap_start, SIMPLEFS_BITMAP_BLOCKS, 1);
+}
+
+// Metadata changes only mark what they touched; flush_metadata() journals
+// just those sectors
+static void mark_inode_dirty(const struct simplefs_inode *inode) {
+    uint32_t start = (uint32_t) ((const char *) inode - (const char *) fs.inodes);
+    uint32_t first = start / SIMPLEFS_BLOCK_SIZE;
+    uint32_t last = (start + sizeof(*inode) - 1) / SIMPLEFS_BLOCK_SIZE;  // Inodes may straddle sectors
+
+    for (uint32_t i = first; i <= last; i++) {
+        fs.dirty_inodes[i / 32] |= 1u << (i % 32);
+    }
+}
+
+static bool inode_sector_dirty(uint32_t i) {
+    return fs.dirty_inodes[i / 32] & (1u << (i % 32));
+}
+
+// Log position -> sector; the header occupies the first journal sector
+static uint32_t journal_sector(uint32_t pos) {
+    return fs.sb.journal_start + 1 + pos;
+}
+
+static void journal_write_header(uint32_t tail, uint32_t tail_seq) {
+    struct simplefs_journal_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SIMPLEFS_JOURNAL_MAGIC;
+    hdr.id = fs.journal_id;
+    hdr.tail = tail;
+    hdr.tail_seq = tail_seq;
+    read_write_disk(&hdr, fs.sb.journal_start, 1);
+}
+
+static uint32_t journal_checksum(const uint8_t *p, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Metadata blocks outside the inode table (indirect extent blocks) are
+// held in the running transaction until it commits
+static struct simplefs_journal_extra *journal_find_extra(uint32_t lba) {
+    for (uint32_t i = 0; i < fs.journal_nextra; i++) {
+        if (fs.journal_extra[i].lba == lba) {
+            return &fs.journal_extra[i];
         }
     }
     return NULL;
 }
 
-// Find inode by filename
+static int meta_read(uint32_t lba, void *buf) {
+    struct simplefs_journal_extra *x = journal_find_extra(lba);
+    if (x) {
+        memcpy(buf, x->data, SIMPLEFS_BLOCK_SIZE);
+        return 0;
+    }
+    return read_write_disk(buf, lba, 0);
+}
+
+static void meta_write(uint32_t lba, const void *buf) {
+    struct simplefs_journal_extra *x = journal_find_extra(lba);
+    if (!x) {
+        if (fs.journal_nextra == SIMPLEFS_JOURNAL_EXTRA) {
+            // commit_metadata() keeps a slot free, so this is not expected
+            read_write_disk((void *) buf, lba, 1);
+            return;
+        }
+        x = &fs.journal_extra[fs.journal_nextra++];
+        x->lba = lba;
+    }
+    memcpy(x->data, buf, SIMPLEFS_BLOCK_SIZE);
+}
+
+// The block is being freed: drop any pending copy of it
+static void journal_forget(uint32_t lba) {
+    struct simplefs_journal_extra *x = journal_find_extra(lba);
+    if (x) {
+        *x = fs.journal_extra[--fs.journal_nextra];
+    }
+}
+
+// Append one block to the transaction staged in journal_buf
+static void journal_add(uint32_t *n, uint32_t lba, const void *src) {
+    struct simplefs_journal_desc *desc = (struct simplefs_journal_desc *) journal_buf;
+    desc->lba[*n] = lba;
+    memcpy(journal_buf + (*n + 1) * SIMPLEFS_BLOCK_SIZE, src, SIMPLEFS_BLOCK_SIZE);
+    (*n)++;
+}
+
+// Write the staged transaction of n blocks to the log, then to its home
+// location. Each flush_disk() is an ordering point:
+//   1. file data and the home copies of the previous transaction are on
+//      disk, so the header can move the replay start past them
+//   2. descriptor + blocks are on disk before the commit record
+//   3. the commit record is on disk before any home copy is written
+// A disk error at any of these points abandons the transaction before its
+// home copies are written; the next commit retries it at the same log
+// position. Returns -1 in that case.
+static int journal_commit(uint32_t n) {
+    struct simplefs_journal_desc *desc = (struct simplefs_journal_desc *) journal_buf;
+    struct simplefs_journal_desc rec;
+    uint32_t log_size = fs.sb.journal_blocks - 1;
+
+    if (flush_disk() < 0) {
+        return -1;
+    }
+
+    // Transactions never wrap; start over at the front of the log
+    if (fs.journal_head + n + 2 > log_size) {
+        fs.journal_head = 0;
+    }
+    journal_write_header(fs.journal_head, fs.journal_seq);
+
+    desc->magic = SIMPLEFS_JDESC_MAGIC;
+    desc->id = fs.journal_id;
+    desc->seq = fs.journal_seq;
+    desc->count = n;
+    desc->checksum = 0;
+    if (read_write_disk_range(journal_buf, journal_sector(fs.journal_head), n + 1, 1) < 0 ||
+        flush_disk() < 0) {
+        return -1;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = SIMPLEFS_JCOMMIT_MAGIC;
+    rec.id = fs.journal_id;
+    rec.seq = fs.journal_seq;
+    rec.count = n;
+    rec.checksum = journal_checksum(journal_buf, (n + 1) * SIMPLEFS_BLOCK_SIZE);
+    if (read_write_disk(&rec, journal_sector(fs.journal_head + n + 1), 1) < 0 ||
+        flush_disk() < 0) {
+        return -1;
+    }
+
+    // Checkpoint lazily: home copies sit in the buffer cache until the
+    // next commit or sync
+    for (uint32_t i = 0; i < n; i++) {
+        read_write_disk(journal_buf + (i + 1) * SIMPLEFS_BLOCK_SIZE, desc->lba[i], 1);
+    }
+
+    fs.journal_head += n + 2;
+    fs.journal_seq++;
+    return 0;
+}
+
+// Read and verify the transaction at log position pos. Returns its block
+// count (descriptor + blocks left in journal_buf), or 0 if there is no
+// complete transaction with sequence number seq there.
+static uint32_t journal_read_txn(uint32_t pos, uint32_t seq) {
+    struct simplefs_journal_desc *desc = (struct simplefs_journal_desc *) journal_buf;
+    struct simplefs_journal_desc rec;
+    uint32_t log_size = fs.sb.journal_blocks - 1;
+
+    if (pos + 2 > log_size) {
+        return 0;
+    }
+    if (read_write_disk(journal_buf, journal_sector(pos), 0) < 0) {
+        return 0;
+    }
+    uint32_t n = desc->count;
+    if (desc->magic != SIMPLEFS_JDESC_MAGIC || desc->id != fs.journal_id || desc->seq != seq ||
+        n == 0 || n > SIMPLEFS_JOURNAL_TXN_MAX || pos + n + 2 > log_size) {
+        return 0;
+    }
+
+    if (read_write_disk_range(journal_buf + SIMPLEFS_BLOCK_SIZE, journal_sector(pos + 1), n, 0) < 0) {
+        return 0;
+    }
+    if (read_write_disk(&rec, journal_sector(pos + n + 1), 0) < 0) {
+        return 0;
+    }
+    if (rec.magic != SIMPLEFS_JCOMMIT_MAGIC || rec.id != fs.journal_id || rec.seq != seq ||
+        rec.count != n || rec.checksum != journal_checksum(journal_buf, (n + 1) * SIMPLEFS_BLOCK_SIZE)) {
+        return 0;
+    }
+    return n;
+}
+
+// Redo every committed transaction from the header's tail onwards.
+// Returns the number of transactions replayed.
+static int journal_replay(void) {
+    struct simplefs_journal_header hdr;
+    if (read_write_disk(&hdr, fs.sb.journal_start, 0) < 0 || hdr.magic != SIMPLEFS_JOURNAL_MAGIC) {
+        return -1;
+    }
+
+    fs.journal_id = hdr.id;
+    uint32_t pos = hdr.tail;
+    uint32_t seq = hdr.tail_seq;
+    int replayed = 0;
+    uint32_t n;
+
+    while ((n = journal_read_txn(pos, seq)) > 0) {
+        struct simplefs_journal_desc *desc = (struct simplefs_journal_desc *) journal_buf;
+        for (uint32_t i = 0; i < n; i++) {
+            read_write_disk(journal_buf + (i + 1) * SIMPLEFS_BLOCK_SIZE, desc->lba[i], 1);
+        }
+        pos += n + 2;
+        seq++;
+        replayed++;
+    }
+
+    fs.journal_head = pos;
+    fs.journal_seq = seq;
+    // If the home copies didn't all make it, leave the header alone so the
+    // next mount replays them again
+    if (replayed > 0 && flush_disk() == 0) {
+        journal_write_header(pos, seq);
+        flush_disk();
+    }
+    return replayed;
+}
+
+// Commit the running transaction: every dirty inode sector, the bitmap,
+// the superblock and pending indirect blocks, as one atomic unit
+static void flush_metadata(void) {
+    const char *table = (const char *) fs.inodes;
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < SIMPLEFS_INODE_BLOCKS; i++) {
+        if (inode_sector_dirty(i)) {
+            journal_add(&n, fs.sb.inode_start + i, table + i * SIMPLEFS_BLOCK_SIZE);
+        }
+    }
+    if (fs.bitmap_dirty) {
+        journal_add(&n, fs.sb.bitmap_start, fs.bitmap);
+    }
+    if (fs.sb_dirty) {
+        journal_add(&n, 0, &fs.sb);
+    }
+    for (uint32_t i = 0; i < fs.journal_nextra; i++) {
+        journal_add(&n, fs.journal_extra[i].lba, fs.journal_extra[i].data);
+    }
+
+    // On failure everything stays dirty and goes into the next attempt
+    if (n > 0 && journal_commit(n) < 0) {
+        printf("SimpleFS: disk error, metadata not committed\n");
+        return;
+    }
+
+    memset(fs.dirty_inodes, 0, sizeof(fs.dirty_inodes));
+    memset(fs.freeing, 0, sizeof(fs.freeing));  // Safe to reuse once committed
+    fs.bitmap_dirty = false;
+    fs.sb_dirty = false;
+    fs.journal_nextra = 0;
+    fs.pending_updates = 0;
+}
+
+// End of a metadata-changing operation: commit now, or let several
+// operations share one transaction (group commit) in deferred mode.
+// An operation adds at most one indirect block, so one slot stays free.
+static void commit_metadata(void) {
+    fs.pending_updates++;
+    if (!fs.deferred || fs.pending_updates >= SIMPLEFS_FLUSH_INTERVAL ||
+        fs.journal_nextra >= SIMPLEFS_JOURNAL_EXTRA - 1) {
+        flush_metadata();
+    }
+}
+
+// FNV-1a hash of a filename, reduced to a bucket index
+static uint32_t filename_hash(const char *filename) {
+    uint32_t h = 2166136261u;
+    while (*filename) {
+        h ^= (uint8_t) *filename++;
+        h *= 16777619u;
+    }
+    return h & (SIMPLEFS_HASH_BUCKETS - 1);
+}
+
+static void index_insert(int ino) {
+    uint32_t h = filename_hash(fs.inodes[ino].filename);
+    fs.hash_next[ino] = fs.hash_head[h];
+    fs.hash_head[h] = ino;
+}
+
+static void index_remove(int ino) {
+    int16_t *link = &fs.hash_head[filename_hash(fs.inodes[ino].filename)];
+    while (*link >= 0) {
+        if (*link == ino) {
+            *link = fs.hash_next[ino];
+            break;
+        }
+        link = &fs.hash_next[*link];
+    }
+    fs.hash_next[ino] = -1;
+}
+
+// Rebuild the filename index and free-inode list from the inode table
+static void build_index(void) {
+    for (int i = 0; i < SIMPLEFS_HASH_BUCKETS; i++) {
+        fs.hash_head[i] = -1;
+    }
+    fs.free_head = -1;
+
+    // Walk backwards so the free list pops the lowest index first
+    for (int i = SIMPLEFS_MAX_FILES - 1; i >= 0; i--) {
+        fs.hash_next[i] = -1;
+        if (fs.inodes[i].in_use) {
+            index_insert(i);
+        } else {
+            fs.free_next[i] = fs.free_head;
+            fs.free_head = i;
+        }
+    }
+}
+
+// Take an inode off the free list
+static struct simplefs_inode *find_free_inode(void) {
+    int ino = fs.free_head;
+    if (ino < 0) {
+        return NULL;
+    }
+    fs.free_head = fs.free_next[ino];
+    return &fs.inodes[ino];
+}
+
+// Find inode by filename through the hash index
 static struct simplefs_inode *find_inode(const char *filename) {
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i++) {
-        if (fs.inodes[i].in_use && strcmp(fs.inodes[i].filename, filename) == 0) {
+    for (int i = fs.hash_head[filename_hash(filename)]; i >= 0; i = fs.hash_next[i]) {
+        if (strcmp(fs.inodes[i].filename, filename) == 0) {
             return &fs.inodes[i];
         }
     }
     return NULL;
 }
 
-// Allocate a data block
-static int alloc_block(void) {
-    // Start from block after inode table
-    int start_block = 1 + (SIMPLEFS_MAX_FILES * sizeof(struct simplefs_inode) + SIMPLEFS_BLOCK_SIZE - 1) / SIMPLEFS_BLOCK_SIZE;
-    
-    // Simple linear search for free block (in real FS, use bitmap)
-    // For now, we track in-use blocks by checking inodes
-    bool used[SIMPLEFS_DATA_BLOCKS] = {false};
-    
-    // Mark blocks used by existing files
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i++) {
-        if (fs.inodes[i].in_use) {
-            for (int j = 0; j < 4; j++) {
-                if (fs.inodes[i].blocks[j] != 0) {
-                    int block_idx = fs.inodes[i].blocks[j] - start_block;
-                    if (block_idx >= 0 && block_idx < SIMPLEFS_DATA_BLOCKS) {
-                        used[block_idx] = true;
+// Blocks freed in the running transaction stay reserved until it commits,
+// so a crash can't leave old metadata pointing at reused blocks
+static bool block_free(uint32_t idx) {
+    return !((fs.bitmap[idx / 32] | fs.freeing[idx / 32]) & (1u << (idx % 32)));
+}
+
+// Index of the first free data block at or after from, or -1.
+// Full words are skipped whole; bsf finds the bit inside a word.
+static int next_free_block(uint32_t from) {
+    uint32_t w = from / 32;
+    if (w >= SIMPLEFS_BITMAP_WORDS) {
+        return -1;
+    }
+
+    uint32_t word = ~(fs.bitmap[w] | fs.freeing[w]) & (0xFFFFFFFFu << (from % 32));
+    while (word == 0) {
+        if (++w >= SIMPLEFS_BITMAP_WORDS) {
+            return -1;
+        }
+        word = ~(fs.bitmap[w] | fs.freeing[w]);
+    }
+    return w * 32 + __builtin_ctz(word);
+}
+
+// Allocate up to want contiguous blocks, preferably starting at goal so the
+// file grows in place. Otherwise the first run of want free blocks is
+// used, or failing that the longest run found. Returns the first block
+// (absolute sector) and stores the run length in *got, or -1 if full.
+static int alloc_run(uint32_t want, uint32_t goal, uint32_t *got) {
+    uint32_t start = 0, len = 0;
+    uint32_t goal_idx = goal - fs.sb.data_start;
+
+    if (goal >= fs.sb.data_start && goal_idx < fs.sb.data_blocks && block_free(goal_idx)) {
+        start = goal_idx;
+        while (len < want && start + len < fs.sb.data_blocks && block_free(start + len)) {
+            len++;
+        }
+    } else {
+        int i = next_free_block(fs.bitmap_hint * 32);
+        if (i >= 0) {
+            fs.bitmap_hint = i / 32;  // Everything below is in use
+        }
+        while (i >= 0 && len < want) {
+            uint32_t run = 0;
+            while (run < want && i + run < fs.sb.data_blocks && block_free(i + run)) {
+                run++;
+            }
+            if (run > len) {
+                start = i;
+                len = run;
+            }
+            i = next_free_block(i + run);
+        }
+    }
+
+    if (len == 0) {
+        return -1;  // No free blocks
+    }
+
+    for (uint32_t i = start; i < start + len; i++) {
+        fs.bitmap[i / 32] |= 1u << (i % 32);
+    }
+    fs.sb.free_blocks -= len;
+    fs.bitmap_dirty = true;
+    fs.sb_dirty = true;
+    *got = len;
+    return fs.sb.data_start + start;
+}
+
+// Return a run of data blocks to the bitmap
+static void free_run(uint32_t block, uint32_t count) {
+    for (uint32_t b = block; b < block + count; b++) {
+        uint32_t idx = b - fs.sb.data_start;
+        if (b < fs.sb.data_start || idx >= fs.sb.data_blocks) {
+            continue;
+        }
+
+        uint32_t w = idx / 32;
+        uint32_t mask = 1u << (idx % 32);
+        if (fs.bitmap[w] & mask) {
+            fs.bitmap[w] &= ~mask;
+            fs.freeing[w] |= mask;
+            fs.sb.free_blocks++;
+            fs.bitmap_dirty = true;
+            fs.sb_dirty = true;
+            if (w < fs.bitmap_hint) {
+                fs.bitmap_hint = w;
+            }
+        }
+    }
+}
+
+// Gather an inode's extent list (direct + indirect) into exts. Returns the
+// number of extents, or -1 if the indirect block can't be read.
+static int load_extents(const struct simplefs_inode *inode, struct simplefs_extent *exts) {
+    uint32_t n = inode->extent_count;
+    uint32_t direct = n < SIMPLEFS_DIRECT_EXTENTS ? n : SIMPLEFS_DIRECT_EXTENTS;
+
+    memcpy(exts, inode->extents, direct * sizeof(struct simplefs_extent));
+    if (n > SIMPLEFS_DIRECT_EXTENTS) {
+        struct simplefs_extent ind[SIMPLEFS_INDIRECT_EXTENTS];
+        if (meta_read(inode->indirect, ind) < 0) {
+            return -1;
+        }
+        memcpy(exts + SIMPLEFS_DIRECT_EXTENTS, ind,
+               (n - SIMPLEFS_DIRECT_EXTENTS) * sizeof(struct simplefs_extent));
+    }
+    return n;
+}
+
+// Write an extent list back; the indirect block must already exist if needed
+static void store_extents(struct simplefs_inode *inode, const struct simplefs_extent *exts, uint32_t n) {
+    uint32_t direct = n < SIMPLEFS_DIRECT_EXTENTS ? n : SIMPLEFS_DIRECT_EXTENTS;
+
+    memset(inode->extents, 0, sizeof(inode->extents));
+    memcpy(inode->extents, exts, direct * sizeof(struct simplefs_extent));
+    if (n > SIMPLEFS_DIRECT_EXTENTS) {
+        struct simplefs_extent ind[SIMPLEFS_INDIRECT_EXTENTS];
+        memset(ind, 0, sizeof(ind));
+        memcpy(ind, exts + SIMPLEFS_DIRECT_EXTENTS,
+               (n - SIMPLEFS_DIRECT_EXTENTS) * sizeof(struct simplefs_extent));
+        meta_write(inode->indirect, ind);
+    } else if (inode->indirect) {
+        journal_forget(inode->indirect);
+        free_run(inode->indirect, 1);
+        inode->indirect = 0;
+    }
+    inode->extent_count = n;
+}
+
+// Make sure the inode owns at least target blocks; returns how many it
+// has, or -1 if its extent list can't be read
+static int inode_grow(struct simplefs_inode *inode, uint32_t target) {
+    struct simplefs_extent exts[SIMPLEFS_MAX_EXTENTS];
+    int loaded = load_extents(inode, exts);
+    if (loaded < 0) {
+        return -1;
+    }
+    uint32_t n = loaded;
+    uint32_t have = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        have += exts[i].length;
+    }
+    if (have >= target) {
+        return have;
+    }
+
+    while (have < target) {
+        uint32_t goal = n ? exts[n - 1].start + exts[n - 1].length : 0;
+        uint32_t got;
+        int start = alloc_run(target - have, goal, &got);
+        if (start < 0) {
+            break;
+        }
+
+        if (n > 0 && (uint32_t) start == goal) {
+            exts[n - 1].length += got;  // Grew in place
+        } else {
+            if (n == SIMPLEFS_MAX_EXTENTS) {
+                free_run(start, got);
+                break;
+            }
+            if (n == SIMPLEFS_DIRECT_EXTENTS && !inode->indirect) {
+                uint32_t one;
+                int ind = alloc_run(1, 0, &one);
+                if (ind < 0) {
+                    free_run(start, got);
+                    break;
+                }
+                inode->indirect = ind;
+            }
+            exts[n].start = start;
+            exts[n].length = got;
+            n++;
+        }
+        have += got;
+    }
+
+    store_extents(inode, exts, n);
+    return have;
+}
+
+// Release every block past the first keep blocks of the file. Returns -1,
+// changing nothing, if its extent list can't be read.
+static int inode_truncate(struct simplefs_inode *inode, uint32_t keep) {
+    struct simplefs_extent exts[SIMPLEFS_MAX_EXTENTS];
+    int loaded = load_extents(inode, exts);
+    if (loaded < 0) {
+        return -1;
+    }
+    uint32_t n = loaded;
+    uint32_t pos = 0, kept = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (pos >= keep) {
+            free_run(exts[i].start, exts[i].length);
+        } else if (pos + exts[i].length > keep) {
+            uint32_t cut = keep - pos;
+            free_run(exts[i].start + cut, exts[i].length - cut);
+            exts[i].length = cut;
+            kept = i + 1;
+        } else {
+            kept = i + 1;
+        }
+        pos += exts[i].length;
+    }
+
+    store_extents(inode, exts, kept);
+    return 0;
+}
+
+// Move len bytes at byte offset off of the file to/from buf. Whole blocks
+// inside an extent go out as one multi-sector request; partial blocks use
+// a bounce buffer (read-modify-write when writing over existing data).
+// Returns -1 on a disk error.
+static int inode_io(const struct simplefs_inode *inode, uint32_t off, char *buf, size_t len, int is_write) {
+    struct simplefs_extent exts[SIMPLEFS_MAX_EXTENTS];
+    int loaded = load_extents(inode, exts);
+    if (loaded < 0) {
+        return -1;
+    }
+    uint32_t n = loaded;
+    uint32_t ext_first = 0;  // File block where the current extent starts
+
+    for (uint32_t e = 0; e < n && len > 0; e++) {
+        uint32_t ext_end = (ext_first + exts[e].length) * SIMPLEFS_BLOCK_SIZE;
+
+        while (len > 0 && off < ext_end) {
+            uint32_t blk = off / SIMPLEFS_BLOCK_SIZE - ext_first;
+            uint32_t lba = exts[e].start + blk;
+            uint32_t in_blk = off % SIMPLEFS_BLOCK_SIZE;
+            size_t chunk;
+
+            if (in_blk == 0 && len >= SIMPLEFS_BLOCK_SIZE) {
+                uint32_t nblk = len / SIMPLEFS_BLOCK_SIZE;
+                if (nblk > exts[e].length - blk) {
+                    nblk = exts[e].length - blk;
+                }
+                chunk = nblk * SIMPLEFS_BLOCK_SIZE;
+                if (read_write_disk_range(buf, lba, nblk, is_write) < 0) {
+                    return -1;
+                }
+            } else {
+                char block_buf[SIMPLEFS_BLOCK_SIZE];
+                chunk = SIMPLEFS_BLOCK_SIZE - in_blk;
+                if (chunk > len) {
+                    chunk = len;
+                }
+
+                if (!is_write || off - in_blk < inode->size) {
+                    if (read_write_disk(block_buf, lba, 0) < 0) {
+                        return -1;
                     }
+                } else {
+                    memset(block_buf, 0, SIMPLEFS_BLOCK_SIZE);  // Nothing to preserve
+                }
+                if (is_write) {
+                    memcpy(block_buf + in_blk, buf, chunk);
+                    if (read_write_disk(block_buf, lba, 1) < 0) {
+                        return -1;
+                    }
+                } else {
+                    memcpy(buf, block_buf + in_blk, chunk);
                 }
             }
+
+            buf += chunk;
+            off += chunk;
+            len -= chunk;
         }
+        ext_first += exts[e].length;
     }
-    
-    // Find first free block
-    for (int i = 0; i < SIMPLEFS_DATA_BLOCKS; i++) {
-        if (!used[i]) {
-            return start_block + i;
+    return 0;
+}
+
+// Drop every open descriptor (the files they refer to are going away)
+static void close_all_files(void) {
+    for (int fd = 0; fd < SIMPLEFS_MAX_OPEN; fd++) {
+        if (fs.files[fd]) {
+            kfree(fs.files[fd]);
+            fs.files[fd] = NULL;
         }
     }
-    
-    return -1;  // No free blocks
+}
+
+// Every inode number is about to name a different file (format or
+// mount): cached pages go, and mappings of the old files stop resolving
+static void forget_all_inodes(void) {
+    for (int ino = 0; ino < SIMPLEFS_MAX_FILES; ino++) {
+        page_cache_invalidate(ino);
+        fs.generation[ino]++;
+    }
 }
 
 // Format the disk with simplefs
-void simplefs_format(void) {
+static void simplefs_format_locked(void) {
     printf("Formatting disk with SimpleFS...\n");
+    forget_all_inodes();
     
     // Initialize superblock
     memset(&fs.sb, 0, sizeof(fs.sb));
     fs.sb.magic = SIMPLEFS_MAGIC;
-    fs.sb.total_blocks = 4096;  // 2MB with 512-byte blocks
-    fs.sb.inode_blocks = (SIMPLEFS_MAX_FILES * sizeof(struct simplefs_inode) + SIMPLEFS_BLOCK_SIZE - 1) / SIMPLEFS_BLOCK_SIZE;
-    fs.sb.data_blocks = SIMPLEFS_DATA_BLOCKS;
+    fs.sb.version = SIMPLEFS_VERSION;
+    fs.sb.total_blocks = SIMPLEFS_TOTAL_BLOCKS;
+    fs.sb.inode_blocks = sizeof(fs.inodes) / SIMPLEFS_BLOCK_SIZE;
+    fs.sb.bitmap_start = 1;
+    fs.sb.inode_start = fs.sb.bitmap_start + SIMPLEFS_BITMAP_BLOCKS;
+    fs.sb.journal_start = fs.sb.inode_start + fs.sb.inode_blocks;
+    fs.sb.journal_blocks = SIMPLEFS_JOURNAL_BLOCKS;
+    fs.sb.data_start = fs.sb.journal_start + fs.sb.journal_blocks;
+    fs.sb.data_blocks = fs.sb.total_blocks - fs.sb.data_start;
+    if (fs.sb.data_blocks > SIMPLEFS_DATA_BLOCKS) {
+        fs.sb.data_blocks = SIMPLEFS_DATA_BLOCKS;
+    }
     fs.sb.free_inodes = SIMPLEFS_MAX_FILES;
-    fs.sb.free_blocks = SIMPLEFS_DATA_BLOCKS;
+    fs.sb.free_blocks = fs.sb.data_blocks;
     
     // Write superblock to sector 0
-    read_write_disk(&fs.sb, 0, 1);
+    write_superblock();
+    
+    // Empty bitmap; bits past the end of the disk are permanently in use
+    memset(fs.bitmap, 0, sizeof(fs.bitmap));
+    for (uint32_t i = fs.sb.data_blocks; i < SIMPLEFS_DATA_BLOCKS; i++) {
+        fs.bitmap[i / 32] |= 1u << (i % 32);
+    }
+    fs.bitmap_hint = 0;
+    int err = write_bitmap();
     
     // Initialize inodes
     memset(fs.inodes, 0, sizeof(fs.inodes));
     
-    // Write inode table starting at sector 1
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i += (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))) {
-        int inodes_per_block = SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode);
-        int sector = 1 + i / inodes_per_block;
-        read_write_disk(&fs.inodes[i], sector, 1);
+    // Write inode table
+    err |= write_inode_table();
+    
+    // Empty journal. A new id makes records left by the previous
+    // filesystem unrecognisable.
+    struct simplefs_journal_header old;
+    if (read_write_disk(&old, fs.sb.journal_start, 0) < 0) {
+        old.magic = 0;
+    }
+    fs.journal_id = old.magic == SIMPLEFS_JOURNAL_MAGIC ? old.id + 1 : 1;
+    fs.journal_head = 0;
+    fs.journal_seq = 1;
+    journal_write_header(fs.journal_head, fs.journal_seq);
+    err |= flush_disk();
+    
+    memset(fs.dirty_inodes, 0, sizeof(fs.dirty_inodes));
+    memset(fs.freeing, 0, sizeof(fs.freeing));
+    fs.sb_dirty = false;
+    fs.bitmap_dirty = false;
+    fs.journal_nextra = 0;
+    fs.pending_updates = 0;
+    close_all_files();
+    build_index();
+    
+    if (err < 0) {
+        printf("Disk write error! Format failed.\n");
+        fs.mounted = false;
+        return;
     }
     
     fs.mounted = true;
@@ -96,31 +749,72 @@ void simplefs_format(void) {
 }
 
 // Mount the filesystem
-void simplefs_mount(void) {
+static void simplefs_mount_locked(void) {
     printf("Mounting SimpleFS...\n");
+    forget_all_inodes();
     
     // Read superblock from sector 0
-    read_write_disk(&fs.sb, 0, 0);
+    if (read_write_disk(&fs.sb, 0, 0) < 0) {
+        printf("Disk read error! Mount failed.\n");
+        fs.mounted = false;
+        return;
+    }
     
-    if (fs.sb.magic != SIMPLEFS_MAGIC) {
+    if (fs.sb.magic != SIMPLEFS_MAGIC || fs.sb.version != SIMPLEFS_VERSION) {
         printf("Invalid filesystem! Please format first.\n");
         fs.mounted = false;
         return;
     }
     
-    // Read inode table
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i += (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))) {
-        int inodes_per_block = SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode);
-        int sector = 1 + i / inodes_per_block;
-        read_write_disk(&fs.inodes[i], sector, 0);
+    // Bring the home copies up to date with committed transactions
+    // before trusting them
+    int replayed = journal_replay();
+    if (replayed < 0) {
+        printf("Journal header missing! Please format first.\n");
+        fs.mounted = false;
+        return;
+    }
+    if (replayed > 0) {
+        printf("Journal: replayed %d transaction(s)\n", replayed);
+        if (read_write_disk(&fs.sb, 0, 0) < 0) {
+            printf("Disk read error! Mount failed.\n");
+            fs.mounted = false;
+            return;
+        }
     }
     
+    // Read allocation bitmap and inode table
+    if (read_write_disk_range(fs.bitmap, fs.sb.bitmap_start, SIMPLEFS_BITMAP_BLOCKS, 0) < 0 ||
+        read_inode_table() < 0) {
+        printf("Disk read error! Mount failed.\n");
+        fs.mounted = false;
+        return;
+    }
+    
+    // Recount free blocks from the bitmap so free_blocks is always truthful
+    uint32_t used = 0;
+    for (int w = 0; w < SIMPLEFS_BITMAP_WORDS; w++) {
+        for (uint32_t v = fs.bitmap[w]; v; v &= v - 1) {
+            used++;
+        }
+    }
+    fs.sb.free_blocks = SIMPLEFS_DATA_BLOCKS - used;
+    fs.bitmap_hint = 0;
+    memset(fs.dirty_inodes, 0, sizeof(fs.dirty_inodes));
+    memset(fs.freeing, 0, sizeof(fs.freeing));
+    fs.sb_dirty = false;
+    fs.bitmap_dirty = false;
+    fs.journal_nextra = 0;
+    fs.pending_updates = 0;
+    close_all_files();
+    build_index();
+    
     fs.mounted = true;
     printf("Filesystem mounted successfully!\n");
 }
 
 // List all files
-void simplefs_ls(void) {
+static void simplefs_ls_locked(void) {
     if (!fs.mounted) {
         printf("Filesystem not mounted!\n");
         return;
@@ -138,10 +832,11 @@ void simplefs_ls(void) {
         printf("  (no files)\n");
     }
     printf("Total: %d files\n", count);
+    printf("Free: %d of %d blocks\n", fs.sb.free_blocks, fs.sb.data_blocks);
 }
 
 // Create a new file
-int simplefs_create(const char *filename) {
+static int simplefs_create_locked(const char *filename) {
     if (!fs.mounted) {
         printf("Filesystem not mounted!\n");
         return -1;
@@ -163,22 +858,18 @@ int simplefs_create(const char *filename) {
     strcpy(inode->filename, filename);
     inode->in_use = 1;
     inode->size = 0;
-    
-    // Write inode table back to disk
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i += (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))) {
-        int inodes_per_block = SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode);
-        int sector = 1 + i / inodes_per_block;
-        read_write_disk(&fs.inodes[i], sector, 1);
-    }
+    index_insert(inode - fs.inodes);
     
     fs.sb.free_inodes--;
-    read_write_disk(&fs.sb, 0, 1);
+    mark_inode_dirty(inode);
+    fs.sb_dirty = true;
+    commit_metadata();
     
     return 0;
 }
 
 // Delete a file
-int simplefs_delete(const char *filename) {
+static int simplefs_delete_locked(const char *filename) {
     if (!fs.mounted) {
         printf("Filesystem not mounted!\n");
         return -1;
@@ -189,24 +880,37 @@ int simplefs_delete(const char *filename) {
         return -1;  // Not found
     }
     
-    // Mark inode as free
+    // Release data blocks and mark inode as free
+    int ino = inode - fs.inodes;
+    if (inode_truncate(inode, 0) < 0) {
+        return -1;
+    }
+    page_cache_invalidate(ino);
+    fs.generation[ino]++;
+    index_remove(ino);
     inode->in_use = 0;
+    inode->size = 0;
+    fs.free_next[ino] = fs.free_head;
+    fs.free_head = ino;
     
-    // Write inode table back to disk
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i += (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))) {
-        int inodes_per_block = SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode);
-        int sector = 1 + i / inodes_per_block;
-        read_write_disk(&fs.inodes[i], sector, 1);
+    // Descriptors still open on it go stale rather than following the
+    // inode to its next owner
+    for (int fd = 0; fd < SIMPLEFS_MAX_OPEN; fd++) {
+        if (fs.files[fd] && fs.files[fd]->ino == ino) {
+            fs.files[fd]->ino = -1;
+        }
     }
     
     fs.sb.free_inodes++;
-    read_write_disk(&fs.sb, 0, 1);
+    mark_inode_dirty(inode);
+    fs.sb_dirty = true;
+    commit_metadata();
     
     return 0;
 }
 
 // Read file contents
-int simplefs_read(const char *filename, char *buf, size_t max_len) {
+static int simplefs_read_locked(const char *filename, char *buf, size_t max_len) {
     if (!fs.mounted) {
         printf("Filesystem not mounted!\n");
         return -1;
@@ -218,29 +922,15 @@ int simplefs_read(const char *filename, char *buf, size_t max_len) {
     }
     
     size_t to_read = inode->size < max_len ? inode->size : max_len;
-    size_t offset = 0;
-    
-    // Read from data blocks
-    for (int i = 0; i < 4 && offset < to_read; i++) {
-        if (inode->blocks[i] == 0) break;
-        
-        char block_buf[SIMPLEFS_BLOCK_SIZE];
-        read_write_disk(block_buf, inode->blocks[i], 0);
-        
-        size_t to_copy = to_read - offset;
-        if (to_copy > SIMPLEFS_BLOCK_SIZE) {
-            to_copy = SIMPLEFS_BLOCK_SIZE;
-        }
-        
-        memcpy(buf + offset, block_buf, to_copy);
-        offset += to_copy;
+    if (inode_io(inode, 0, buf, to_read, 0) < 0) {
+        return -1;
     }
     
-    return offset;
+    return to_read;
 }
 
 // Write file contents
-int simplefs_write(const char *filename, const char *buf, size_t len) {
+static int simplefs_write_locked(const char *filename, const char *buf, size_t len) {
     if (!fs.mounted) {
         printf("Filesystem not mounted!\n");
         return -1;
@@ -251,65 +941,497 @@ int simplefs_write(const char *filename, const char *buf, size_t len) {
         return -1;  // Not found
     }
     
-    // Limit to 4 blocks
-    if (len > SIMPLEFS_BLOCK_SIZE * 4) {
-        len = SIMPLEFS_BLOCK_SIZE * 4;
+    // Cached pages of the old contents are dropped
+    page_cache_invalidate(inode - fs.inodes);
+    
+    // Resize the block list: drop the tail, then grow (in place if possible)
+    uint32_t need = (len + SIMPLEFS_BLOCK_SIZE - 1) / SIMPLEFS_BLOCK_SIZE;
+    if (inode_truncate(inode, need) < 0) {
+        return -1;
+    }
+    // Can't fail now: the extent list was just loaded and stored
+    uint32_t have = inode_grow(inode, need);
+    size_t offset = len;
+    if (have < need) {
+        offset = have * SIMPLEFS_BLOCK_SIZE;  // Disk full
     }
     
-    size_t offset = 0;
-    int block_idx = 0;
+    // Old contents are replaced entirely, so no read-modify-write needed
+    inode->size = 0;
+    int ret = inode_io(inode, 0, (char *) buf, offset, 1);
+    inode->size = offset;
     
-    while (offset < len && block_idx < 4) {
-        // Allocate block if needed
-        if (inode->blocks[block_idx] == 0) {
-            int new_block = alloc_block();
-            if (new_block < 0) {
-                break;  // No more free blocks
-            }
-            inode->blocks[block_idx] = new_block;
+    mark_inode_dirty(inode);
+    commit_metadata();
+    
+    return ret < 0 ? -1 : (int) offset;
+}
+
+// Cat file contents, streamed in multi-block chunks
+static void simplefs_cat_locked(const char *filename) {
+    if (!fs.mounted) {
+        printf("Filesystem not mounted!\n");
+        return;
+    }
+    
+    struct simplefs_inode *inode = find_inode(filename);
+    if (!inode) {
+        printf("File not found: %s\n", filename);
+        return;
+    }
+    
+    char buf[8 * SIMPLEFS_BLOCK_SIZE];
+    for (uint32_t off = 0; off < inode->size; off += sizeof(buf)) {
+        size_t n = inode->size - off < sizeof(buf) ? inode->size - off : sizeof(buf);
+        if (inode_io(inode, off, buf, n, 0) < 0) {
+            printf("\nDisk read error\n");
+            return;
         }
-        
-        // Write to block
-        char block_buf[SIMPLEFS_BLOCK_SIZE];
-        memset(block_buf, 0, SIMPLEFS_BLOCK_SIZE);
-        
-        size_t to_copy = len - offset;
-        if (to_copy > SIMPLEFS_BLOCK_SIZE) {
-            to_copy = SIMPLEFS_BLOCK_SIZE;
+        for (size_t i = 0; i < n; i++) {
+            putchar(buf[i]);
         }
-        
-        memcpy(block_buf, buf + offset, to_copy);
-        read_write_disk(block_buf, inode->blocks[block_idx], 1);
-        
-        offset += to_copy;
-        block_idx++;
+    }
+    putchar('\n');
+}
+
+// Commit all pending metadata to the journal
+static void simplefs_sync_locked(void) {
+    if (fs.mounted) {
+        flush_metadata();
+    }
+}
+
+// In deferred mode metadata updates are coalesced in memory and committed
+// as one journal transaction on simplefs_sync_locked() or every
+// SIMPLEFS_FLUSH_INTERVAL updates
+static void simplefs_set_deferred_locked(bool deferred) {
+    fs.deferred = deferred;
+    if (!deferred) {
+        simplefs_sync_locked();
+    }
+}
+
+// True if fd is open in the calling process
+static bool fd_owned(int fd) {
+    return fd >= 0 && fd < SIMPLEFS_MAX_OPEN && fs.files[fd] && fs.files[fd]->owner == current_pid();
+}
+
+// Inode behind an open descriptor, or NULL
+static struct simplefs_inode *fd_inode(int fd) {
+    if (!fs.mounted || !fd_owned(fd) || fs.files[fd]->ino < 0) {
+        return NULL;
+    }
+    return &fs.inodes[fs.files[fd]->ino];
+}
+
+// Zero the bytes [from, to) of a file that already owns the blocks
+static int inode_zero(struct simplefs_inode *inode, uint32_t from, uint32_t to) {
+    static char zero[SIMPLEFS_BLOCK_SIZE];
+    while (from < to) {
+        uint32_t chunk = SIMPLEFS_BLOCK_SIZE - from % SIMPLEFS_BLOCK_SIZE;
+        if (chunk > to - from) {
+            chunk = to - from;
+        }
+        if (inode_io(inode, from, zero, chunk, 1) < 0) {
+            return -1;
+        }
+        from += chunk;
+    }
+    return 0;
+}
+
+// Open a file and return its descriptor
+static int simplefs_open_locked(const char *filename, int flags) {
+    if (!fs.mounted) {
+        printf("Filesystem not mounted!\n");
+        return -1;
     }
     
-    inode->size = offset;
+    int fd = 0;
+    while (fd < SIMPLEFS_MAX_OPEN && fs.files[fd]) {
+        fd++;
+    }
+    if (fd == SIMPLEFS_MAX_OPEN) {
+        return -2;  // Open-file table full
+    }
     
-    // Write inode table back to disk
-    for (int i = 0; i < SIMPLEFS_MAX_FILES; i += (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))) {
-        int inodes_per_block = SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode);
-        int sector = 1 + i / inodes_per_block;
-        read_write_disk(&fs.inodes[i], sector, 1);
+    struct simplefs_inode *inode = find_inode(filename);
+    if (!inode) {
+        if (!(flags & SIMPLEFS_O_CREAT)) {
+            return -1;  // Not found
+        }
+        int ret = simplefs_create_locked(filename);
+        if (ret < 0) {
+            return ret;
+        }
+        inode = find_inode(filename);
+    } else if ((flags & SIMPLEFS_O_TRUNC) && inode->size > 0) {
+        if (inode_truncate(inode, 0) < 0) {
+            return -1;
+        }
+        page_cache_invalidate(inode - fs.inodes);
+        inode->size = 0;
+        mark_inode_dirty(inode);
+        commit_metadata();
     }
     
-    return offset;
+    struct simplefs_file *file = kmalloc(sizeof(*file));
+    file->ino = inode - fs.inodes;
+    file->offset = 0;
+    file->owner = current_pid();
+    fs.files[fd] = file;
+    return fd;
 }
 
-// Cat file contents
-void simplefs_cat(const char *filename) {
-    char buf[SIMPLEFS_MAX_FILE_SIZE];
-    int bytes = simplefs_read(filename, buf, sizeof(buf));
+static int simplefs_close_locked(int fd) {
+    if (!fd_owned(fd)) {
+        return -1;
+    }
+    kfree(fs.files[fd]);
+    fs.files[fd] = NULL;
+    return 0;
+}
+
+// Drop every descriptor a process has open, for exit and exec
+static void simplefs_close_all_locked(int pid) {
+    for (int fd = 0; fd < SIMPLEFS_MAX_OPEN; fd++) {
+        if (fs.files[fd] && fs.files[fd]->owner == pid) {
+            kfree(fs.files[fd]);
+            fs.files[fd] = NULL;
+        }
+    }
+}
+
+// Read up to len bytes at byte offset off; only the blocks covering the
+// range are touched
+static int simplefs_pread_locked(int fd, void *buf, size_t len, uint32_t off) {
+    struct simplefs_inode *inode = fd_inode(fd);
+    if (!inode) {
+        return -1;
+    }
     
-    if (bytes < 0) {
-        printf("File not found: %s\n", filename);
-        return;
+    if (off >= inode->size) {
+        return 0;  // End of file
+    }
+    if (len > inode->size - off) {
+        len = inode->size - off;
+    }
+    if (inode_io(inode, off, (char *) buf, len, 0) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// Write len bytes at byte offset off, growing the file as needed. Existing
+// blocks outside the range are left alone; a gap past the old end reads
+// back as zeros.
+static int simplefs_pwrite_locked(int fd, const void *buf, size_t len, uint32_t off) {
+    struct simplefs_inode *inode = fd_inode(fd);
+    if (!inode) {
+        return -1;
+    }
+    if (off >= SIMPLEFS_MAX_FILE_SIZE) {
+        return -2;
+    }
+    if (len > SIMPLEFS_MAX_FILE_SIZE - off) {
+        len = SIMPLEFS_MAX_FILE_SIZE - off;
+    }
+    
+    uint32_t end = off + len;
+    if (end > inode->size) {
+        uint32_t need = (end + SIMPLEFS_BLOCK_SIZE - 1) / SIMPLEFS_BLOCK_SIZE;
+        int have = inode_grow(inode, need);
+        if (have < 0) {
+            return -1;
+        }
+        if ((uint32_t) have < need) {
+            end = have * SIMPLEFS_BLOCK_SIZE;  // Disk full
+        }
+        if (end <= off) {
+            mark_inode_dirty(inode);
+            commit_metadata();
+            return -2;
+        }
+        len = end - off;
+        
+        if (off > inode->size) {
+            if (inode_zero(inode, inode->size, off) < 0) {
+                mark_inode_dirty(inode);
+                commit_metadata();
+                return -1;
+            }
+            inode->size = off;
+        }
+    }
+    
+    if (inode_io(inode, off, (char *) buf, len, 1) < 0) {
+        if (end > inode->size) {
+            mark_inode_dirty(inode);
+            commit_metadata();
+        }
+        return -1;
     }
+    page_cache_update(inode - fs.inodes, off, buf, len);  // Keep mmap()ed pages current
     
-    for (int i = 0; i < bytes; i++) {
-        putchar(buf[i]);
+    if (end > inode->size) {
+        inode->size = end;
+        mark_inode_dirty(inode);
+        commit_metadata();
     }
-    putchar('\n');
+    return len;
+}
+
+// Sequential read from the descriptor's offset
+static int simplefs_fread_locked(int fd, void *buf, size_t len) {
+    if (!fd_inode(fd)) {
+        return -1;
+    }
+    int ret = simplefs_pread_locked(fd, buf, len, fs.files[fd]->offset);
+    if (ret > 0) {
+        fs.files[fd]->offset += ret;
+    }
+    return ret;
+}
+
+// Sequential write at the descriptor's offset
+static int simplefs_fwrite_locked(int fd, const void *buf, size_t len) {
+    if (!fd_inode(fd)) {
+        return -1;
+    }
+    int ret = simplefs_pwrite_locked(fd, buf, len, fs.files[fd]->offset);
+    if (ret > 0) {
+        fs.files[fd]->offset += ret;
+    }
+    return ret;
+}
+
+// Write at the current end of file: only the last partial block and the
+// new blocks are written. The descriptor's offset moves to the new end.
+static int simplefs_append_locked(int fd, const void *buf, size_t len) {
+    struct simplefs_inode *inode = fd_inode(fd);
+    if (!inode) {
+        return -1;
+    }
+    int ret = simplefs_pwrite_locked(fd, buf, len, inode->size);
+    if (ret >= 0) {
+        fs.files[fd]->offset = inode->size;
+    }
+    return ret;
+}
+
+// Move the descriptor's offset; returns the new offset
+static int simplefs_seek_locked(int fd, int32_t off, int whence) {
+    struct simplefs_inode *inode = fd_inode(fd);
+    if (!inode) {
+        return -1;
+    }
+    
+    int32_t base;
+    switch (whence) {
+        case SIMPLEFS_SEEK_SET: base = 0; break;
+        case SIMPLEFS_SEEK_CUR: base = fs.files[fd]->offset; break;
+        case SIMPLEFS_SEEK_END: base = inode->size; break;
+        default: return -1;
+    }
+    
+    int32_t pos = base + off;
+    if (pos < 0 || pos > (int32_t) SIMPLEFS_MAX_FILE_SIZE) {
+        return -1;
+    }
+    fs.files[fd]->offset = pos;
+    return pos;
+}
+
+// Inode number behind an open descriptor, or -1, and its generation
+static int simplefs_fd_ino_locked(int fd, uint32_t *gen) {
+    struct simplefs_inode *inode = fd_inode(fd);
+    if (!inode) {
+        return -1;
+    }
+    int ino = inode - fs.inodes;
+    *gen = fs.generation[ino];
+    return ino;
+}
+
+// In-use inode by number, or NULL if it has been freed since gen was
+// handed out
+static struct simplefs_inode *ino_inode(int ino, uint32_t gen) {
+    if (!fs.mounted || ino < 0 || ino >= SIMPLEFS_MAX_FILES || !fs.inodes[ino].in_use ||
+        fs.generation[ino] != gen) {
+        return NULL;
+    }
+    return &fs.inodes[ino];
+}
+
+// Page cache I/O by inode number. Reads stop at the end of the file and
+// writes never move it. Return the bytes moved, or -1 for a file that is
+// gone.
+int simplefs_ino_pread_locked(int ino, uint32_t gen, void *buf, size_t len, uint32_t off) {
+    struct simplefs_inode *inode = ino_inode(ino, gen);
+    if (!inode) {
+        return -1;
+    }
+    if (off >= inode->size) {
+        return 0;
+    }
+    if (len > inode->size - off) {
+        len = inode->size - off;
+    }
+    if (inode_io(inode, off, (char *) buf, len, 0) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+int simplefs_ino_pwrite_locked(int ino, uint32_t gen, const void *buf, size_t len, uint32_t off) {
+    struct simplefs_inode *inode = ino_inode(ino, gen);
+    if (!inode) {
+        return -1;
+    }
+    if (off >= inode->size) {
+        return 0;
+    }
+    if (len > inode->size - off) {
+        len = inode->size - off;
+    }
+    if (inode_io(inode, off, (char *) buf, len, 1) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// Entry points. Every CPU may use the filesystem, so each call holds the
+// fs lock (a sleeping lock: the disk I/O underneath may block) throughout.
+
+void simplefs_format(void) {
+    fs_lock();
+    simplefs_format_locked();
+    fs_unlock();
+}
+
+void simplefs_mount(void) {
+    fs_lock();
+    simplefs_mount_locked();
+    fs_unlock();
 }
 
+void simplefs_ls(void) {
+    fs_lock();
+    simplefs_ls_locked();
+    fs_unlock();
+}
+
+int simplefs_create(const char *filename) {
+    fs_lock();
+    int ret = simplefs_create_locked(filename);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_delete(const char *filename) {
+    fs_lock();
+    int ret = simplefs_delete_locked(filename);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_read(const char *filename, char *buf, size_t max_len) {
+    fs_lock();
+    int ret = simplefs_read_locked(filename, buf, max_len);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_write(const char *filename, const char *buf, size_t len) {
+    fs_lock();
+    int ret = simplefs_write_locked(filename, buf, len);
+    fs_unlock();
+    return ret;
+}
+
+void simplefs_cat(const char *filename) {
+    fs_lock();
+    simplefs_cat_locked(filename);
+    fs_unlock();
+}
+
+void simplefs_sync(void) {
+    fs_lock();
+    simplefs_sync_locked();
+    fs_unlock();
+}
+
+void simplefs_set_deferred(bool deferred) {
+    fs_lock();
+    simplefs_set_deferred_locked(deferred);
+    fs_unlock();
+}
+
+int simplefs_open(const char *filename, int flags) {
+    fs_lock();
+    int ret = simplefs_open_locked(filename, flags);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_close(int fd) {
+    fs_lock();
+    int ret = simplefs_close_locked(fd);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_pread(int fd, void *buf, size_t len, uint32_t off) {
+    fs_lock();
+    int ret = simplefs_pread_locked(fd, buf, len, off);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_pwrite(int fd, const void *buf, size_t len, uint32_t off) {
+    fs_lock();
+    int ret = simplefs_pwrite_locked(fd, buf, len, off);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_fread(int fd, void *buf, size_t len) {
+    fs_lock();
+    int ret = simplefs_fread_locked(fd, buf, len);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_fwrite(int fd, const void *buf, size_t len) {
+    fs_lock();
+    int ret = simplefs_fwrite_locked(fd, buf, len);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_append(int fd, const void *buf, size_t len) {
+    fs_lock();
+    int ret = simplefs_append_locked(fd, buf, len);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_seek(int fd, int32_t off, int whence) {
+    fs_lock();
+    int ret = simplefs_seek_locked(fd, off, whence);
+    fs_unlock();
+    return ret;
+}
+
+int simplefs_fd_ino(int fd, uint32_t *gen) {
+    fs_lock();
+    int ret = simplefs_fd_ino_locked(fd, gen);
+    fs_unlock();
+    return ret;
+}
+
+void simplefs_close_all(int pid) {
+    fs_lock();
+    simplefs_close_all_locked(pid);
+    fs_unlock();
+}
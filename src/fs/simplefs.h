@@ -4,11 +4,39 @@
 // Simple inode-based filesystem for VirtualBox disk
 
 #define SIMPLEFS_MAGIC 0x53494D50  // "SIMP"
-#define SIMPLEFS_MAX_FILES 64
+#define SIMPLEFS_VERSION 5         // Adds the metadata journal area
+#define SIMPLEFS_MAX_FILES 256
+#define SIMPLEFS_HASH_BUCKETS 128  // Filename index buckets (power of two)
 #define SIMPLEFS_MAX_FILENAME 56
 #define SIMPLEFS_BLOCK_SIZE 512
-#define SIMPLEFS_MAX_FILE_SIZE (128 * SIMPLEFS_BLOCK_SIZE)  // 64KB max per file
-#define SIMPLEFS_DATA_BLOCKS 1024
+#define SIMPLEFS_DIRECT_EXTENTS 6
+#define SIMPLEFS_INDIRECT_EXTENTS (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_extent))
+#define SIMPLEFS_MAX_EXTENTS (SIMPLEFS_DIRECT_EXTENTS + SIMPLEFS_INDIRECT_EXTENTS)
+#define SIMPLEFS_TOTAL_BLOCKS 4096  // 2MB disk
+#define SIMPLEFS_BITMAP_BLOCKS 1
+#define SIMPLEFS_DATA_BLOCKS (SIMPLEFS_BITMAP_BLOCKS * SIMPLEFS_BLOCK_SIZE * 8)  // Bits in the bitmap
+#define SIMPLEFS_BITMAP_WORDS (SIMPLEFS_DATA_BLOCKS / 32)
+#define SIMPLEFS_INODE_BLOCKS ((SIMPLEFS_MAX_FILES * sizeof(struct simplefs_inode)) / SIMPLEFS_BLOCK_SIZE)
+#define SIMPLEFS_FLUSH_INTERVAL 32  // Deferred mode: flush metadata after this many updates
+#define SIMPLEFS_MAX_OPEN 16        // Open-file table entries
+
+// simplefs_open() flags
+#define SIMPLEFS_O_CREAT 0x1        // Create the file if it doesn't exist
+#define SIMPLEFS_O_TRUNC 0x2        // Discard existing contents
+
+// simplefs_seek() whence
+#define SIMPLEFS_SEEK_SET 0
+#define SIMPLEFS_SEEK_CUR 1
+#define SIMPLEFS_SEEK_END 2
+
+// Metadata journal: header sector + circular log of transactions
+#define SIMPLEFS_JOURNAL_BLOCKS 128
+#define SIMPLEFS_JOURNAL_MAGIC  0x4A524E4C  // "JRNL" (header)
+#define SIMPLEFS_JDESC_MAGIC    0x4A444553  // "JDES" (transaction descriptor)
+#define SIMPLEFS_JCOMMIT_MAGIC  0x4A434D54  // "JCMT" (commit record)
+#define SIMPLEFS_JOURNAL_EXTRA   8           // Indirect blocks buffered per transaction
+// Largest transaction: every inode sector, bitmap, superblock and extras
+#define SIMPLEFS_JOURNAL_TXN_MAX (SIMPLEFS_INODE_BLOCKS + 2 + SIMPLEFS_JOURNAL_EXTRA)
 
 // Superblock - first sector of disk
 struct simplefs_superblock {
@@ -18,28 +46,98 @@ struct simplefs_superblock {
     uint32_t data_blocks;        // Number of data blocks
     uint32_t free_inodes;        // Number of free inodes
     uint32_t free_blocks;        // Number of free data blocks
-    uint8_t padding[SIMPLEFS_BLOCK_SIZE - 24];
+    uint32_t version;            // SIMPLEFS_VERSION
+    uint32_t bitmap_start;       // First sector of the free-block bitmap
+    uint32_t inode_start;        // First sector of the inode table
+    uint32_t data_start;         // Sector of data block 0 (bitmap bit 0)
+    uint32_t journal_start;      // Journal header sector; the log follows it
+    uint32_t journal_blocks;     // Header + log sectors
+    uint8_t padding[SIMPLEFS_BLOCK_SIZE - 48];
+} __attribute__((packed));
+
+// Extent - a run of physically contiguous data blocks
+struct simplefs_extent {
+    uint32_t start;              // First block (absolute sector number)
+    uint32_t length;             // Number of blocks
 } __attribute__((packed));
 
 // Inode - file metadata
 struct simplefs_inode {
     char filename[SIMPLEFS_MAX_FILENAME];  // File name
     uint32_t size;               // File size in bytes
-    uint32_t blocks[4];          // Direct block pointers (4 blocks = 2KB)
     uint8_t in_use;              // 1 if in use, 0 if free
     uint8_t padding[3];
+    struct simplefs_extent extents[SIMPLEFS_DIRECT_EXTENTS];  // File blocks, in order
+    uint32_t indirect;           // Block holding further extents (0 = none)
+    uint32_t extent_count;       // Extents in use, direct + indirect
+    uint8_t reserved[8];
+} __attribute__((packed));
+
+// Journal header - where replay starts
+struct simplefs_journal_header {
+    uint32_t magic;              // SIMPLEFS_JOURNAL_MAGIC
+    uint32_t id;                 // Changes on every format; stale records won't match
+    uint32_t tail;               // Log position of the oldest transaction to scan
+    uint32_t tail_seq;           // Sequence number expected at tail
+    uint8_t padding[SIMPLEFS_BLOCK_SIZE - 16];
+} __attribute__((packed));
+
+// Transaction descriptor: followed by count metadata blocks, then a commit record
+struct simplefs_journal_desc {
+    uint32_t magic;              // SIMPLEFS_JDESC_MAGIC or SIMPLEFS_JCOMMIT_MAGIC
+    uint32_t id;
+    uint32_t seq;
+    uint32_t count;              // Blocks in the transaction
+    uint32_t checksum;           // Commit record: checksum of the logged blocks
+    uint32_t lba[(SIMPLEFS_BLOCK_SIZE - 20) / 4];  // Descriptor: home sector of each block
 } __attribute__((packed));
 
+// A metadata block outside the inode table (e.g. indirect extents)
+// waiting in the running transaction
+struct simplefs_journal_extra {
+    uint32_t lba;
+    uint8_t data[SIMPLEFS_BLOCK_SIZE];
+};
+
+// Open-file table entry (kmalloc'd); the table index is the file descriptor
+struct simplefs_file {
+    int16_t ino;                 // -1 once the file has been deleted
+    uint32_t offset;             // Position for simplefs_fread/simplefs_fwrite
+    int owner;                   // Pid of the process that opened it
+};
+
 // In-memory filesystem state
 struct simplefs_state {
     struct simplefs_superblock sb;
     struct simplefs_inode inodes[SIMPLEFS_MAX_FILES];
+    uint32_t bitmap[SIMPLEFS_BITMAP_WORDS];  // 1 bit per data block, set = in use
+    uint32_t bitmap_hint;        // No free bit in any word below this index
+    uint32_t dirty_inodes[(SIMPLEFS_INODE_BLOCKS + 31) / 32];  // 1 bit per inode-table sector
+    bool sb_dirty;
+    bool bitmap_dirty;
+    bool deferred;               // Coalesce metadata writes until sync/flush interval
+    uint32_t pending_updates;    // Metadata updates since the last flush
+    int16_t hash_head[SIMPLEFS_HASH_BUCKETS];  // Filename index: first inode per bucket
+    int16_t hash_next[SIMPLEFS_MAX_FILES];     // Next inode in the same bucket (-1 = end)
+    int16_t free_head;                         // Free-inode list, lowest index first
+    int16_t free_next[SIMPLEFS_MAX_FILES];
+    uint32_t freeing[SIMPLEFS_BITMAP_WORDS];  // Freed in the running transaction; not reusable yet
+    struct simplefs_journal_extra journal_extra[SIMPLEFS_JOURNAL_EXTRA];
+    uint32_t journal_nextra;
+    uint32_t journal_id;
+    uint32_t journal_head;       // Log position for the next transaction
+    uint32_t journal_seq;        // Sequence number of the next transaction
+    struct simplefs_file *files[SIMPLEFS_MAX_OPEN];
+    uint32_t generation[SIMPLEFS_MAX_FILES];  // Bumped when an inode is freed, so its next file differs
     bool mounted;
 };
 
 // Global filesystem state (defined in simplefs.c)
 extern struct simplefs_state fs;
 
+// Largest file: every data block, limited by the extent count
+#define SIMPLEFS_MAX_FILE_SIZE (SIMPLEFS_DATA_BLOCKS * SIMPLEFS_BLOCK_SIZE)
+
 // Filesystem operations
 void simplefs_format(void);
 void simplefs_mount(void);
@@ -49,4 +147,26 @@ int simplefs_delete(const char *filename);
 int simplefs_read(const char *filename, char *buf, size_t max_len);
 int simplefs_write(const char *filename, const char *buf, size_t len);
 void simplefs_cat(const char *filename);
+void simplefs_sync(void);
+void simplefs_set_deferred(bool deferred);
+
+// File descriptor operations. Byte counts are returned on success,
+// -1 for a bad descriptor/name or a disk error and -2 when out of table
+// slots or space. A descriptor belongs to the process that opened it and
+// is a bad descriptor for every other one.
+int simplefs_open(const char *filename, int flags);
+int simplefs_close(int fd);
+int simplefs_pread(int fd, void *buf, size_t len, uint32_t off);
+int simplefs_pwrite(int fd, const void *buf, size_t len, uint32_t off);
+int simplefs_fread(int fd, void *buf, size_t len);
+int simplefs_fwrite(int fd, const void *buf, size_t len);
+int simplefs_append(int fd, const void *buf, size_t len);
+int simplefs_seek(int fd, int32_t off, int whence);
+int simplefs_fd_ino(int fd, uint32_t *gen);
+void simplefs_close_all(int pid);
+
+// For the page cache, by inode number and generation (from
+// simplefs_fd_ino); the caller holds the fs lock
+int simplefs_ino_pread_locked(int ino, uint32_t gen, void *buf, size_t len, uint32_t off);
+int simplefs_ino_pwrite_locked(int ino, uint32_t gen, const void *buf, size_t len, uint32_t off);
 
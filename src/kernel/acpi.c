@@ -0,0 +1,155 @@
+#include "acpi.h"
+#include "common.h"
+#include "kernel.h"
+
+#define EBDA_SEGMENT_PTR 0x40E   // BIOS data area word: EBDA segment
+#define BIOS_ROM_START   0xE0000
+#define BIOS_ROM_END     0x100000
+
+// MADT entry types
+#define MADT_LAPIC        0
+#define MADT_IOAPIC       1
+#define MADT_IRQ_OVERRIDE 2
+
+#define MADT_LAPIC_ENABLED 1
+
+struct rsdp {
+    char signature[8];           // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+} __attribute__((packed));
+
+struct sdt_header {
+    char signature[4];
+    uint32_t length;             // Including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct madt {
+    struct sdt_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    uint8_t entries[];           // Type, length, then type-specific fields
+} __attribute__((packed));
+
+struct madt_lapic {
+    uint8_t type, length;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    uint8_t type, length;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_irq_override {
+    uint8_t type, length;
+    uint8_t bus;                 // Always 0 (ISA)
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct acpi_info acpi;
+
+static bool checksum_ok(const void *p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++)
+        sum += ((const uint8_t *) p)[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary in the first KB of the EBDA or in
+// the BIOS ROM area
+static struct rsdp *find_rsdp_in(paddr_t start, paddr_t end) {
+    for (paddr_t p = start; p + sizeof(struct rsdp) <= end; p += 16) {
+        struct rsdp *rsdp = (struct rsdp *) p;
+        if (strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum_ok(rsdp, sizeof(*rsdp)))
+            return rsdp;
+    }
+    return NULL;
+}
+
+static struct rsdp *find_rsdp(void) {
+    paddr_t ebda = (paddr_t) *(volatile uint16_t *) EBDA_SEGMENT_PTR << 4;
+    struct rsdp *rsdp = NULL;
+    if (ebda)
+        rsdp = find_rsdp_in(ebda, ebda + 1024);
+    if (!rsdp)
+        rsdp = find_rsdp_in(BIOS_ROM_START, BIOS_ROM_END);
+    return rsdp;
+}
+
+static void parse_madt(struct madt *madt) {
+    uint8_t *p = madt->entries;
+    uint8_t *end = (uint8_t *) madt + madt->header.length;
+
+    while (p + 2 <= end && p[1] >= 2) {
+        switch (p[0]) {
+            case MADT_LAPIC: {
+                struct madt_lapic *e = (struct madt_lapic *) p;
+                if ((e->flags & MADT_LAPIC_ENABLED) && acpi.ncpus < CPUS_MAX)
+                    acpi.apic_ids[acpi.ncpus++] = e->apic_id;
+                break;
+            }
+            case MADT_IOAPIC: {
+                struct madt_ioapic *e = (struct madt_ioapic *) p;
+                if (!acpi.ioapic_addr) {   // Only the first one is used
+                    acpi.ioapic_addr = e->addr;
+                    acpi.ioapic_gsi_base = e->gsi_base;
+                }
+                break;
+            }
+            case MADT_IRQ_OVERRIDE: {
+                struct madt_irq_override *e = (struct madt_irq_override *) p;
+                if (e->irq < IRQ_COUNT) {
+                    acpi.irq_gsi[e->irq] = e->gsi;
+                    acpi.irq_flags[e->irq] = e->flags;
+                }
+                break;
+            }
+        }
+        p += p[1];
+    }
+}
+
+// Find the MADT through the RSDP and RSDT and copy out what the kernel
+// needs. The tables are usually at the top of RAM, outside the kernel's
+// mapping, so this runs before paging is turned on. Returns false if
+// there is no MADT; the system then runs on the boot CPU alone.
+bool acpi_init(void) {
+    for (int irq = 0; irq < IRQ_COUNT; irq++)
+        acpi.irq_gsi[irq] = irq;   // ISA IRQs map 1:1 unless overridden
+
+    struct rsdp *rsdp = find_rsdp();
+    if (!rsdp)
+        return false;
+
+    struct sdt_header *rsdt = (struct sdt_header *) rsdp->rsdt_addr;
+    if (strncmp(rsdt->signature, "RSDT", 4) != 0 || !checksum_ok(rsdt, rsdt->length))
+        return false;
+
+    uint32_t *tables = (uint32_t *) (rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(*rsdt)) / sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        struct sdt_header *h = (struct sdt_header *) tables[i];
+        if (strncmp(h->signature, "APIC", 4) == 0 && checksum_ok(h, h->length)) {
+            parse_madt((struct madt *) h);
+            return acpi.ncpus > 0;
+        }
+    }
+    return false;
+}
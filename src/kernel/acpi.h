@@ -0,0 +1,25 @@
+#pragma once
+#include "common.h"
+#include "kernel.h"
+
+// ACPI table discovery: the MADT lists the CPUs' local APIC IDs, the I/O
+// APIC and how ISA IRQs are wired to its inputs
+
+// MADT interrupt source override flags (0 in a field: bus default)
+#define ACPI_IRQ_POLARITY     0x0003
+#define ACPI_IRQ_ACTIVE_LOW   0x0003
+#define ACPI_IRQ_TRIGGER      0x000C
+#define ACPI_IRQ_LEVEL        0x000C
+
+struct acpi_info {
+    uint32_t ncpus;              // Enabled CPUs, at most CPUS_MAX
+    uint8_t apic_ids[CPUS_MAX];  // Their local APIC IDs, in MADT order
+    paddr_t ioapic_addr;         // 0 if there is no I/O APIC
+    uint32_t ioapic_gsi_base;    // First global system interrupt it handles
+    uint32_t irq_gsi[IRQ_COUNT]; // I/O APIC input of each ISA IRQ
+    uint16_t irq_flags[IRQ_COUNT];
+};
+
+extern struct acpi_info acpi;
+
+bool acpi_init(void);
@@ -0,0 +1,114 @@
+#include "apic.h"
+#include "common.h"
+#include "kernel.h"
+#include "acpi.h"
+
+static volatile uint32_t *lapic;   // Register window, NULL without a local APIC
+static volatile uint32_t *ioapic;  // Select/window pair, NULL when the PIC is used
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void) lapic[LAPIC_REG_ID / 4];   // Wait for the write to land
+}
+
+bool lapic_available(void) {
+    return lapic != NULL;
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+// Send an inter-processor interrupt and wait until the APIC has delivered it
+void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        cpu_relax();
+}
+
+// Map and enable this CPU's local APIC. The 8259 PIC stays in charge of
+// device IRQs, passed through LINT0 (virtual wire mode).
+bool lapic_init(void) {
+    if ((cpu_features & (CPUID_APIC | CPUID_MSR)) != (CPUID_APIC | CPUID_MSR))
+        return false;
+
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    paddr_t paddr = (uint32_t) base & ~0xfff;
+    wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+    map_mmio(paddr);
+    lapic = (volatile uint32_t *) paddr;
+
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    return true;
+}
+
+// Enable an application processor's local APIC, at the address the boot
+// CPU mapped. Device IRQs only ever reach the boot CPU, so LINT0 is masked.
+void lapic_init_ap(void) {
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WINDOW / 4] = value;
+}
+
+bool ioapic_available(void) {
+    return ioapic != NULL;
+}
+
+// Take device IRQs over from the PIC, which stays fully masked. Every
+// input starts masked; irq_unmask() routes the ones drivers use. Needs
+// the local APIC and an I/O APIC in the MADT.
+bool ioapic_init(void) {
+    if (!lapic || !acpi.ioapic_addr)
+        return false;
+
+    map_mmio(acpi.ioapic_addr);
+    ioapic = (volatile uint32_t *) acpi.ioapic_addr;
+
+    uint32_t entries = ((ioapic_read(IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+    for (uint32_t i = 0; i < entries; i++) {
+        ioapic_write(IOAPIC_REG_REDIR + 2 * i, IOAPIC_MASKED);
+        ioapic_write(IOAPIC_REG_REDIR + 2 * i + 1, 0);
+    }
+
+    // The PIC no longer delivers anything through LINT0
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    return true;
+}
+
+// Deliver an ISA IRQ to one CPU at vector IRQ_BASE + irq, with the wiring
+// the MADT's overrides describe (ISA default: edge, active high)
+void ioapic_route_irq(int irq, uint32_t apic_id) {
+    uint32_t input = acpi.irq_gsi[irq] - acpi.ioapic_gsi_base;
+    uint32_t low = IRQ_BASE + irq;
+    if ((acpi.irq_flags[irq] & ACPI_IRQ_POLARITY) == ACPI_IRQ_ACTIVE_LOW)
+        low |= IOAPIC_ACTIVE_LOW;
+    if ((acpi.irq_flags[irq] & ACPI_IRQ_TRIGGER) == ACPI_IRQ_LEVEL)
+        low |= IOAPIC_LEVEL;
+
+    ioapic_write(IOAPIC_REG_REDIR + 2 * input + 1, apic_id << 24);
+    ioapic_write(IOAPIC_REG_REDIR + 2 * input, low);
+}
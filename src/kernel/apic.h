@@ -0,0 +1,64 @@
+#pragma once
+#include "common.h"
+
+// Local APIC: the per-CPU interrupt controller, with its own timer and
+// inter-processor interrupts. I/O APIC: routes device IRQs to CPUs.
+
+// Vectors above the PIC's 0x20-0x2F
+#define LAPIC_TIMER_VECTOR    0x30
+#define LAPIC_RESCHED_VECTOR  0x31    // IPI: work was queued for this CPU
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Register offsets
+#define LAPIC_REG_ID          0x020
+#define LAPIC_REG_EOI         0x0B0
+#define LAPIC_REG_SVR         0x0F0   // Spurious vector, software enable
+#define LAPIC_REG_ICR_LOW     0x300   // Interrupt command: writing sends the IPI
+#define LAPIC_REG_ICR_HIGH    0x310   // Destination APIC ID in bits 24-31
+#define LAPIC_REG_LVT_TIMER   0x320
+#define LAPIC_REG_LVT_LINT0   0x350
+#define LAPIC_REG_LVT_LINT1   0x360
+#define LAPIC_REG_TIMER_INIT  0x380
+#define LAPIC_REG_TIMER_COUNT 0x390
+#define LAPIC_REG_TIMER_DIV   0x3E0
+
+// Local vector table bits
+#define LAPIC_LVT_EXTINT   (7 << 8)
+#define LAPIC_LVT_NMI      (4 << 8)
+#define LAPIC_LVT_MASKED   (1 << 16)
+#define LAPIC_LVT_PERIODIC (1 << 17)
+
+// Interrupt command register bits
+#define LAPIC_ICR_INIT     (5 << 8)
+#define LAPIC_ICR_STARTUP  (6 << 8)    // Vector field: start page number
+#define LAPIC_ICR_PENDING  (1 << 12)   // Delivery status
+#define LAPIC_ICR_ASSERT   (1 << 14)
+#define LAPIC_ICR_LEVEL    (1 << 15)
+
+#define LAPIC_SVR_ENABLE   (1 << 8)
+#define LAPIC_TIMER_DIV_16 0x3
+#define APIC_BASE_ENABLE   (1 << 11)   // In MSR_APIC_BASE
+
+// I/O APIC registers, through the select/window pair
+#define IOAPIC_REGSEL      0x00
+#define IOAPIC_WINDOW      0x10
+#define IOAPIC_REG_VERSION 0x01       // Highest redirection entry in bits 16-23
+#define IOAPIC_REG_REDIR   0x10       // Entry n: registers 0x10 + 2n (low), +1 (high)
+
+// Redirection entry bits (low word)
+#define IOAPIC_ACTIVE_LOW  (1 << 13)
+#define IOAPIC_LEVEL       (1 << 15)
+#define IOAPIC_MASKED      (1 << 16)
+
+bool lapic_init(void);
+void lapic_init_ap(void);
+bool lapic_available(void);
+uint32_t lapic_id(void);
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+void lapic_eoi(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+
+bool ioapic_init(void);
+bool ioapic_available(void);
+void ioapic_route_irq(int irq, uint32_t apic_id);
@@ -32,3 +32,65 @@ _start:
     hlt
     jmp .hang
 
+# Application processor start-up code. smp_init() copies it to
+# AP_TRAMPOLINE (0x8000, see smp.h) and starts each AP there in real mode
+# with CS = 0x800. It loads a temporary flat GDT, enters protected mode,
+# turns on paging with the boot CPU's control registers from the
+# parameter block (struct ap_boot_params) and calls ap_main(index) on the
+# CPU's own stack. Addresses are computed relative to the copy.
+.set AP_TRAMPOLINE, 0x8000
+
+.global ap_trampoline, ap_trampoline_end, ap_boot_params
+.code16
+ap_trampoline:
+    cli
+    cld
+    mov %cs, %ax
+    mov %ax, %ds
+    lgdtl ap_gdt_ptr - ap_trampoline
+    mov %cr0, %eax
+    or $1, %eax                                     # PE
+    mov %eax, %cr0
+    ljmpl $0x08, $(AP_TRAMPOLINE + ap_protected - ap_trampoline)
+
+.code32
+ap_protected:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    mov %ax, %ss
+    mov $(AP_TRAMPOLINE + ap_boot_params - ap_trampoline), %esi
+
+    mov 8(%esi), %eax                               # CR4 without PGE for now
+    and $~0x80, %eax
+    mov %eax, %cr4
+    mov 4(%esi), %eax
+    mov %eax, %cr3
+    mov 0(%esi), %eax                               # Paging on
+    mov %eax, %cr0
+    mov 8(%esi), %eax                               # Global pages, once paging is on
+    mov %eax, %cr4
+
+    mov 12(%esi), %esp
+    pushl 20(%esi)                                  # CPU index
+    call *16(%esi)
+.ap_hang:
+    cli
+    hlt
+    jmp .ap_hang
+
+.align 8
+ap_gdt:
+    .quad 0                                         # Null descriptor
+    .quad 0x00CF9A000000FFFF                        # Code: flat, 32-bit
+    .quad 0x00CF92000000FFFF                        # Data: flat
+ap_gdt_ptr:
+    .word ap_gdt_ptr - ap_gdt - 1
+    .long AP_TRAMPOLINE + ap_gdt - ap_trampoline
+
+.align 4
+ap_boot_params:
+    .fill 6, 4, 0                                   # cr0, cr3, cr4, stack, entry, index
+ap_trampoline_end:
@@ -1,20 +1,216 @@
 #include "common.h"
 
-void *memset(void *buf, char c, size_t n) {
+// memcpy/memset pick an implementation by size: rep movsd/stosd moves a
+// dword per iteration; with SSE2 (enabled by mem_init) larger blocks go
+// 64 bytes per iteration, and very large ones bypass the cache with
+// non-temporal stores so they don't evict everything else.
+#define MEM_SSE2_MIN 256          // Below this the xmm save/restore doesn't pay off
+#define MEM_NT_MIN   (32 * 1024)  // Non-temporal stores from this size on
+
+static bool mem_sse2;
+
+void mem_init(bool sse2) {
+    mem_sse2 = sse2;
+}
+
+void memcpy_bytes(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dst;
+    const uint8_t *s = (const uint8_t *) src;
+    while (n--)
+        *d++ = *s++;
+}
+
+void memcpy_rep(void *dst, const void *src, size_t n) {
+    uint32_t ecx, edi, esi;
+    __asm__ __volatile__(
+        "rep movsl\n"
+        "movl %4, %%ecx\n"
+        "rep movsb"
+        : "=&c"(ecx), "=&D"(edi), "=&S"(esi)
+        : "0"(n / 4), "g"(n & 3), "1"(dst), "2"(src)
+        : "memory");
+}
+
+// 64 bytes per iteration through xmm0-xmm3. The registers are saved and
+// restored around the loop, so nested use from an interrupt handler and
+// user-mode SSE state are both left intact.
+#define SSE2_COPY_LOOP(store)                \
+    "movdqu %%xmm0,  0(%[save])\n"           \
+    "movdqu %%xmm1, 16(%[save])\n"           \
+    "movdqu %%xmm2, 32(%[save])\n"           \
+    "movdqu %%xmm3, 48(%[save])\n"           \
+    "1:\n"                                   \
+    "movdqu  0(%[s]), %%xmm0\n"              \
+    "movdqu 16(%[s]), %%xmm1\n"              \
+    "movdqu 32(%[s]), %%xmm2\n"              \
+    "movdqu 48(%[s]), %%xmm3\n"              \
+    store " %%xmm0,  0(%[d])\n"              \
+    store " %%xmm1, 16(%[d])\n"              \
+    store " %%xmm2, 32(%[d])\n"              \
+    store " %%xmm3, 48(%[d])\n"              \
+    "addl $64, %[s]\n"                       \
+    "addl $64, %[d]\n"                       \
+    "decl %[n]\n"                            \
+    "jnz 1b\n"                               \
+    "movdqu  0(%[save]), %%xmm0\n"           \
+    "movdqu 16(%[save]), %%xmm1\n"           \
+    "movdqu 32(%[save]), %%xmm2\n"           \
+    "movdqu 48(%[save]), %%xmm3\n"
+
+void memcpy_sse2(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dst;
+    const uint8_t *s = (const uint8_t *) src;
+
+    // Align the destination so the stores can be movdqa/movntdq
+    size_t head = (16 - ((uint32_t) d & 15)) & 15;
+    if (head > n)
+        head = n;
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    uint32_t blocks = n / 64;
+    if (blocks > 0) {
+        uint8_t save[64];
+        if (n >= MEM_NT_MIN) {
+            __asm__ __volatile__(
+                SSE2_COPY_LOOP("movntdq")
+                "sfence"
+                : [s] "+r"(s), [d] "+r"(d), [n] "+r"(blocks)
+                : [save] "r"(save)
+                : "memory", "cc");
+        } else {
+            __asm__ __volatile__(
+                SSE2_COPY_LOOP("movdqa")
+                : [s] "+r"(s), [d] "+r"(d), [n] "+r"(blocks)
+                : [save] "r"(save)
+                : "memory", "cc");
+        }
+    }
+    memcpy_rep(d, s, n & 63);
+}
+
+void memset_bytes(void *buf, char c, size_t n) {
     uint8_t *p = (uint8_t *) buf;
     while (n--)
         *p++ = c;
+}
+
+void memset_rep(void *buf, char c, size_t n) {
+    uint32_t ecx, edi;
+    __asm__ __volatile__(
+        "rep stosl\n"
+        "movl %3, %%ecx\n"
+        "rep stosb"
+        : "=&c"(ecx), "=&D"(edi)
+        : "0"(n / 4), "g"(n & 3), "1"(buf), "a"((uint8_t) c * 0x01010101u)
+        : "memory");
+}
+
+#define SSE2_SET_LOOP(store)                 \
+    "movdqu %%xmm0, (%[save])\n"             \
+    "movd %[v], %%xmm0\n"                    \
+    "pshufd $0, %%xmm0, %%xmm0\n"            \
+    "1:\n"                                   \
+    store " %%xmm0,  0(%[d])\n"              \
+    store " %%xmm0, 16(%[d])\n"              \
+    store " %%xmm0, 32(%[d])\n"              \
+    store " %%xmm0, 48(%[d])\n"              \
+    "addl $64, %[d]\n"                       \
+    "decl %[n]\n"                            \
+    "jnz 1b\n"                               \
+    "movdqu (%[save]), %%xmm0\n"
+
+void memset_sse2(void *buf, char c, size_t n) {
+    uint8_t *d = (uint8_t *) buf;
+    uint32_t v = (uint8_t) c * 0x01010101u;
+
+    size_t head = (16 - ((uint32_t) d & 15)) & 15;
+    if (head > n)
+        head = n;
+    memset_rep(d, c, head);
+    d += head;
+    n -= head;
+
+    uint32_t blocks = n / 64;
+    if (blocks > 0) {
+        uint8_t save[16];
+        if (n >= MEM_NT_MIN) {
+            __asm__ __volatile__(
+                SSE2_SET_LOOP("movntdq")
+                "sfence"
+                : [d] "+r"(d), [n] "+r"(blocks)
+                : [save] "r"(save), [v] "r"(v)
+                : "memory", "cc");
+        } else {
+            __asm__ __volatile__(
+                SSE2_SET_LOOP("movdqa")
+                : [d] "+r"(d), [n] "+r"(blocks)
+                : [save] "r"(save), [v] "r"(v)
+                : "memory", "cc");
+        }
+    }
+    memset_rep(d, c, n & 63);
+}
+
+void *memset(void *buf, char c, size_t n) {
+    if (mem_sse2 && n >= MEM_SSE2_MIN)
+        memset_sse2(buf, c, n);
+    else
+        memset_rep(buf, c, n);
     return buf;
 }
 
 void *memcpy(void *dst, const void *src, size_t n) {
+    if (mem_sse2 && n >= MEM_SSE2_MIN)
+        memcpy_sse2(dst, src, n);
+    else
+        memcpy_rep(dst, src, n);
+    return dst;
+}
+
+// Forward copying is safe unless dst overlaps the end of src; then copy
+// from the top down (trailing bytes first, then whole dwords). Interrupts
+// stay off while DF is set so no handler runs with it.
+void *memmove(void *dst, const void *src, size_t n) {
     uint8_t *d = (uint8_t *) dst;
     const uint8_t *s = (const uint8_t *) src;
-    while (n--)
-        *d++ = *s++;
+
+    if (d <= s || d >= s + n)
+        return memcpy(dst, src, n);
+
+    uint32_t ecx, edi, esi;
+    __asm__ __volatile__(
+        "pushfl\n"
+        "cli\n"
+        "std\n"
+        "rep movsb\n"
+        "subl $3, %%esi\n"
+        "subl $3, %%edi\n"
+        "movl %4, %%ecx\n"
+        "rep movsl\n"
+        "cld\n"
+        "popfl"
+        : "=&c"(ecx), "=&D"(edi), "=&S"(esi)
+        : "0"(n & 3), "r"(n / 4), "1"(d + n - 1), "2"(s + n - 1)
+        : "memory");
     return dst;
 }
 
+// 64-by-32-bit division without libgcc's __udivdi3: divide the high word,
+// then the remainder and the low word, one divl each
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t *rem) {
+    uint32_t hi = n >> 32;
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo;
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"((uint32_t) n), "d"(r), "rm"(d));
+    if (rem)
+        *rem = r;
+    return ((uint64_t) q_hi << 32) | q_lo;
+}
+
 char *strcpy(char *dst, const char *src) {
     char *d = dst;
     while (*src)
@@ -36,6 +232,13 @@ int strncmp(const char *s1, const char *s2, int n) {
     return 0;
 }
 
+size_t strlen(const char *s) {
+    size_t len = 0;
+    while (s[len])
+        len++;
+    return len;
+}
+
 int strcmp(const char *s1, const char *s2) {
     while (*s1 && *s2) {
         if (*s1 != *s2)
@@ -47,65 +250,179 @@ int strcmp(const char *s1, const char *s2) {
     return *(unsigned char *)s1 - *(unsigned char *)s2;
 }
 
-void putchar(char ch);
+void console_write(const char *s, size_t n);
 
-void printf(const char *fmt, ...) {
-    va_list vargs;
-    va_start(vargs, fmt);
-    while (*fmt) {
-        if (*fmt == '%') {
-            fmt++;
-            switch (*fmt) {
-                case '\0':
-                    putchar('%');
-                    goto end;
-                case '%':
-                    putchar('%');
-                    break;
-                case 's': {
-                    const char *s = va_arg(vargs, const char *);
-                    while (*s) {
-                        putchar(*s);
-                        s++;
-                    }
-                    break;
-                }
-                case 'd': {
-                    int value = va_arg(vargs, int);
-                    unsigned magnitude = value;
-                    if (value < 0) {
-                        putchar('-');
-                        magnitude = -magnitude;
-                    }
-
-                    unsigned divisor = 1;
-                    while (magnitude / divisor > 9)
-                        divisor *= 10;
-
-                    while (divisor > 0) {
-                        putchar('0' + magnitude / divisor);
-                        magnitude %= divisor;
-                        divisor /= 10;
-                    }
-
-                    break;
-                }
-                case 'x': {
-                    unsigned value = va_arg(vargs, unsigned);
-                    for (int i = 7; i >= 0; i--) {
-                        unsigned nibble = (value >> (i * 4)) & 0xf;
-                        putchar("0123456789abcdef"[nibble]);
-                    }
-                }
-            }
+// Formatter output: a buffer that printf() hands to the console each time
+// it fills up, or that snprintf() truncates
+struct fmt_out {
+    char *buf;
+    size_t size;                 // Usable bytes in buf
+    size_t len;                  // Bytes in buf
+    size_t total;                // Bytes produced, including any truncated
+    bool to_console;
+};
+
+static void out_char(struct fmt_out *out, char c) {
+    out->total++;
+    if (out->len == out->size) {
+        if (!out->to_console)
+            return;
+        console_write(out->buf, out->len);
+        out->len = 0;
+    }
+    out->buf[out->len++] = c;
+}
+
+static void out_pad(struct fmt_out *out, char c, int count) {
+    while (count-- > 0)
+        out_char(out, c);
+}
+
+// Digits are produced backwards into tmp; 64-bit values only take the
+// slower udiv64() path while they don't fit in 32 bits
+static void out_number(struct fmt_out *out, uint64_t value, bool hex, bool negative,
+                       int width, bool zero_pad, bool left) {
+    char tmp[20];
+    int n = 0;
+    do {
+        if (hex) {
+            tmp[n++] = "0123456789abcdef"[value & 0xf];
+            value >>= 4;
+        } else if (value >> 32) {
+            uint32_t rem;
+            value = udiv64(value, 10, &rem);
+            tmp[n++] = '0' + rem;
         } else {
-            putchar(*fmt);
+            uint32_t v = value;
+            tmp[n++] = '0' + v % 10;
+            value = v / 10;
+        }
+    } while (value);
+
+    int pad = width - n - negative;
+    if (!left && !zero_pad)
+        out_pad(out, ' ', pad);
+    if (negative)
+        out_char(out, '-');
+    if (!left && zero_pad)
+        out_pad(out, '0', pad);
+    while (n > 0)
+        out_char(out, tmp[--n]);
+    if (left)
+        out_pad(out, ' ', pad);
+}
+
+// Conversions: %d %u %x %c %s %%, with an optional '-' (left-justify) or
+// '0' (zero-pad) flag, a field width, and "ll" for 64-bit %d/%u/%x. For
+// compatibility with older output, %x without a width prints every digit.
+static void format(struct fmt_out *out, const char *fmt, va_list vargs) {
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            out_char(out, *fmt);
+            continue;
         }
 
-        fmt++;
+        bool left = false, zero_pad = false;
+        for (fmt++; *fmt == '-' || *fmt == '0'; fmt++) {
+            if (*fmt == '-')
+                left = true;
+            else
+                zero_pad = true;
+        }
+        int width = 0;
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+            width = width * 10 + (*fmt - '0');
+        int longs = 0;
+        for (; *fmt == 'l'; fmt++)
+            longs++;
+        bool wide = longs >= 2;   // long is 32 bits here
+
+        switch (*fmt) {
+            case '\0':
+                out_char(out, '%');
+                return;
+            case '%':
+                out_char(out, '%');
+                break;
+            case 'c':
+                if (!left)
+                    out_pad(out, ' ', width - 1);
+                out_char(out, (char) va_arg(vargs, int));
+                if (left)
+                    out_pad(out, ' ', width - 1);
+                break;
+            case 's': {
+                const char *s = va_arg(vargs, const char *);
+                if (!s)
+                    s = "(null)";
+                int len = strlen(s);
+                if (!left)
+                    out_pad(out, ' ', width - len);
+                while (*s)
+                    out_char(out, *s++);
+                if (left)
+                    out_pad(out, ' ', width - len);
+                break;
+            }
+            case 'd': {
+                int64_t value = wide ? va_arg(vargs, int64_t) : va_arg(vargs, int);
+                uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+                out_number(out, magnitude, false, value < 0, width, zero_pad, left);
+                break;
+            }
+            case 'u': {
+                uint64_t value = wide ? va_arg(vargs, uint64_t) : va_arg(vargs, unsigned);
+                out_number(out, value, false, false, width, zero_pad, left);
+                break;
+            }
+            case 'x': {
+                uint64_t value = wide ? va_arg(vargs, uint64_t) : va_arg(vargs, unsigned);
+                if (width == 0) {
+                    width = wide ? 16 : 8;
+                    zero_pad = true;
+                }
+                out_number(out, value, true, false, width, zero_pad, left);
+                break;
+            }
+            default:   // Unknown conversion: print it as is
+                out_char(out, '%');
+                out_char(out, *fmt);
+                break;
+        }
     }
+}
+
+// Format into a buffer on the stack and write it to the console in spans
+// rather than a byte at a time
+void printf(const char *fmt, ...) {
+    char buf[PRINTF_BUF_SIZE];
+    struct fmt_out out = { buf, sizeof(buf), 0, 0, true };
 
-end:
+    va_list vargs;
+    va_start(vargs, fmt);
+    format(&out, fmt, vargs);
+    va_end(vargs);
+
+    if (out.len > 0)
+        console_write(buf, out.len);
+}
+
+// Like printf, into buf. Output beyond size - 1 bytes is dropped; the
+// result is always terminated (if size > 0). Returns the length the
+// complete output would have had.
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list vargs) {
+    struct fmt_out out = { buf, size ? size - 1 : 0, 0, 0, false };
+    format(&out, fmt, vargs);
+    if (size > 0)
+        buf[out.len] = '\0';
+    return out.total;
+}
+
+int snprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list vargs;
+    va_start(vargs, fmt);
+    int len = vsnprintf(buf, size, fmt, vargs);
     va_end(vargs);
+    return len;
 }
 
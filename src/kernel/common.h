@@ -3,8 +3,11 @@
 typedef int bool;
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
+typedef short int16_t;
 typedef unsigned int uint32_t;
+typedef int int32_t;
 typedef unsigned long long uint64_t;
+typedef long long int64_t;
 typedef uint32_t size_t;
 typedef uint32_t paddr_t;
 typedef uint32_t vaddr_t;
@@ -20,6 +23,7 @@ typedef uint32_t vaddr_t;
 #define va_end   __builtin_va_end
 #define va_arg   __builtin_va_arg
 #define PAGE_SIZE 4096
+#define PRINTF_BUF_SIZE 256   // printf() writes to the console in spans of up to this
 
 // System call numbers
 #define SYS_PUTCHAR 1
@@ -32,11 +36,41 @@ typedef uint32_t vaddr_t;
 #define SYS_ADDF 8
 #define SYS_WRITEF 9
 #define SYS_LS 10
+#define SYS_OPEN 11
+#define SYS_CLOSE 12
+#define SYS_SEEK 13
+#define SYS_PREAD 14
+#define SYS_PWRITE 15
+#define SYS_SBRK 16
+#define SYS_FORK 17
+#define SYS_EXEC 18
+#define SYS_SLEEP 19
+#define SYS_SETPRIO 20
+#define SYS_GETPID 21
+#define SYS_RING_SETUP 22
+#define SYS_RING_ENTER 23
+#define SYS_MMAP 24
+#define SYS_MSYNC 25
+#define SYS_MUNMAP 26
 
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+void mem_init(bool sse2);
+
+// Individual implementations behind memcpy/memset, for benchmarking
+void memcpy_bytes(void *dst, const void *src, size_t n);
+void memcpy_rep(void *dst, const void *src, size_t n);
+void memcpy_sse2(void *dst, const void *src, size_t n);
+void memset_bytes(void *buf, char c, size_t n);
+void memset_rep(void *buf, char c, size_t n);
+void memset_sse2(void *buf, char c, size_t n);
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t *rem);
 char *strcpy(char *dst, const char *src);
 int strcmp(const char *s1, const char *s2);
 int strncmp(const char *s1, const char *s2, int n);
+size_t strlen(const char *s);
 void printf(const char *fmt, ...);
+int snprintf(char *buf, size_t size, const char *fmt, ...);
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list vargs);
 
@@ -8,6 +8,143 @@ isr128:
     pushl $128      # interrupt number
     jmp isr_common
 
+# Fast syscall entry (SYSENTER). Arguments are passed as for int 0x80, and
+# the caller also puts its return address in edi and its stack pointer in
+# ebp. SYSEXIT returns them in edx and ecx, which the call clobbers.
+# The CPU arrives here with interrupts off and esp pointing at this CPU's
+# TSS (MSR_SYSENTER_ESP), so the first thing is to move to the process's
+# kernel stack (esp0, at offset 4). On it goes the same trap frame that
+# int 0x80 would have built.
+.global sysenter_entry
+sysenter_entry:
+    movl 4(%esp), %esp
+    pushl $0x23         # user SS
+    pushl %ebp          # user ESP
+    pushfl
+    orl $0x200, (%esp)  # EFLAGS as the user had them: IF set
+    pushl $0x1B         # user CS
+    pushl %edi          # EIP
+    pushl $0            # dummy error code
+    pushl $128          # interrupt number
+    pushl %eax
+    pushl %ecx
+    pushl %edx
+    pushl %ebx
+    pushl %esp
+    pushl %ebp
+    pushl %esi
+    pushl %edi
+    cld                 # The C code expects DF clear; the user may have set it
+
+    pushl %esp          # Pass pointer to trap_frame
+    call handle_fast_syscall
+    addl $4, %esp
+
+    popl %edi
+    popl %esi
+    popl %ebp
+    addl $4, %esp       # Skip the saved esp
+    popl %ebx
+    addl $8, %esp       # Skip edx and ecx: SYSEXIT takes EIP and ESP in them
+    popl %eax
+    addl $8, %esp       # Skip interrupt number and error code
+    popl %edx           # EIP
+    addl $4, %esp       # Skip CS
+    andl $~0x200, (%esp)
+    popfl               # EFLAGS, still with interrupts off
+    popl %ecx           # ESP
+    sti                 # Takes effect after SYSEXIT, once back in user mode
+    sysexit
+
+# CPU exception stubs (vectors 0-31). The CPU pushes an error code for
+# some exceptions; the others push a dummy so the frame is always the same.
+.macro EXC num
+.global exc\num
+exc\num:
+    pushl $0            # dummy error code
+    pushl $\num         # interrupt number
+    jmp isr_common
+.endm
+
+.macro EXC_ERR num
+.global exc\num
+exc\num:
+    pushl $\num         # interrupt number (error code already pushed)
+    jmp isr_common
+.endm
+
+EXC 0
+EXC 1
+EXC 2
+EXC 3
+EXC 4
+EXC 5
+EXC 6
+EXC 7
+EXC_ERR 8
+EXC 9
+EXC_ERR 10
+EXC_ERR 11
+EXC_ERR 12
+EXC_ERR 13
+EXC_ERR 14
+EXC 15
+EXC 16
+EXC_ERR 17
+EXC 18
+EXC 19
+EXC 20
+EXC_ERR 21
+EXC 22
+EXC 23
+EXC 24
+EXC 25
+EXC 26
+EXC 27
+EXC 28
+EXC_ERR 29
+EXC_ERR 30
+EXC 31
+
+# Hardware IRQ stubs (PIC remapped to vectors 0x20-0x2F)
+.macro IRQ num
+.global irq\num
+irq\num:
+    pushl $0            # dummy error code
+    pushl $(32 + \num)  # interrupt number
+    jmp isr_common
+.endm
+
+IRQ 0
+IRQ 1
+IRQ 2
+IRQ 3
+IRQ 4
+IRQ 5
+IRQ 6
+IRQ 7
+IRQ 8
+IRQ 9
+IRQ 10
+IRQ 11
+IRQ 12
+IRQ 13
+IRQ 14
+IRQ 15
+
+# Local APIC vectors (timer, reschedule IPI, spurious)
+.macro VEC num
+.global vec\num
+vec\num:
+    pushl $0            # dummy error code
+    pushl $\num         # interrupt number
+    jmp isr_common
+.endm
+
+VEC 48
+VEC 49
+VEC 255
+
 # Common ISR handler
 isr_common:
     # Save all registers
@@ -19,17 +156,22 @@ isr_common:
     pushl %ebp
     pushl %esi
     pushl %edi
+    cld             # The C code expects DF clear, whatever was interrupted
     
     # Call C handler
     pushl %esp      # Pass pointer to trap_frame
     call handle_interrupt
     addl $4, %esp   # Clean up argument
-    
+
+# Forked processes start here, returning to user mode through a copy of
+# the parent's trap frame
+.global trap_return
+trap_return:
     # Restore registers
     popl %edi
     popl %esi
     popl %ebp
-    popl %esp
+    addl $4, %esp   # Skip the saved esp
     popl %ebx
     popl %edx
     popl %ecx
@@ -40,10 +182,92 @@ isr_common:
     
     iret
 
-# Dummy ISR for other interrupts
-.global isr0
-isr0:
-    pushl $0
-    pushl $0
-    jmp isr_common
+# User program for the syscallbench shell command: times a null system
+# call (SYS_GETPID) through int 0x80 and through SYSENTER and prints the
+# cycles per call of each. The kernel copies it to USER_BASE like any
+# other image, which the absolute addresses below rely on.
+.set USER_BASE, 0x40000000
+.set SYS_PUTCHAR, 1     # Numbers as in common.h
+.set SYS_EXIT, 3
+.set SYS_GETPID, 21
+.set BENCH_ITERS, 100000
+
+.global syscall_bench_start, syscall_bench_end
+syscall_bench_start:
+    rdtsc
+    pushl %eax
+    movl $BENCH_ITERS, %esi
+1:
+    movl $SYS_GETPID, %eax
+    int $0x80
+    decl %esi
+    jnz 1b
+    rdtsc
+    subl (%esp), %eax
+    addl $4, %esp
+    movl $(USER_BASE + bench_int80_msg - syscall_bench_start), %ebx
+    call bench_report
+
+    rdtsc
+    pushl %eax
+    movl $BENCH_ITERS, %esi
+    movl $(USER_BASE + 2f - syscall_bench_start), %edi   # SYSENTER return address
+1:
+    movl $SYS_GETPID, %eax
+    movl %esp, %ebp
+    sysenter
+2:
+    decl %esi
+    jnz 1b
+    rdtsc
+    subl (%esp), %eax
+    addl $4, %esp
+    movl $(USER_BASE + bench_sysenter_msg - syscall_bench_start), %ebx
+    call bench_report
+
+    movl $SYS_EXIT, %eax
+    int $0x80
+
+# Print the string at ebx, then eax / BENCH_ITERS in decimal
+bench_report:
+    pushl %eax
+    movl %ebx, %esi
+1:
+    movzbl (%esi), %ebx
+    testl %ebx, %ebx
+    jz 2f
+    movl $SYS_PUTCHAR, %eax
+    int $0x80
+    incl %esi
+    jmp 1b
+2:
+    popl %eax
+    xorl %edx, %edx
+    movl $BENCH_ITERS, %ecx
+    divl %ecx
+    movl $10, %ecx
+    xorl %esi, %esi     # Digits pushed
+3:
+    xorl %edx, %edx
+    divl %ecx
+    pushl %edx
+    incl %esi
+    testl %eax, %eax
+    jnz 3b
+4:
+    popl %ebx
+    addl $'0', %ebx
+    movl $SYS_PUTCHAR, %eax
+    int $0x80
+    decl %esi
+    jnz 4b
+    movl $10, %ebx      # Newline
+    movl $SYS_PUTCHAR, %eax
+    int $0x80
+    ret
 
+bench_int80_msg:
+    .asciz "int 0x80 cycles/call: "
+bench_sysenter_msg:
+    .asciz "sysenter cycles/call: "
+syscall_bench_end:
@@ -0,0 +1,97 @@
+#include "io_ring.h"
+#include "common.h"
+#include "kernel.h"
+#include "page_alloc.h"
+#include "simplefs.h"
+
+// Map the current process's ring page, or find the one it already has.
+// The kernel reaches the ring through its identity-mapped physical
+// address, so requests can be run whatever address space is loaded.
+// Returns the user address of the ring.
+uint32_t io_ring_setup(void) {
+    struct process *proc = current_proc;
+    if (!proc->io_ring) {
+        paddr_t page = alloc_pages(1);
+        map_page(proc->page_table, USER_IO_RING, page, PAGE_USER | PAGE_WRITE | PAGE_NOFORK);
+        proc->io_ring = (struct io_ring *) page;
+    }
+    return USER_IO_RING;
+}
+
+// Console output is copied out of user memory in pieces first:
+// console_write() runs with the console lock held and interrupts off,
+// where a page fault can't be taken
+static int32_t io_console(uint32_t addr, uint32_t len) {
+    char buf[256];
+    if (!user_range_ok(addr, len))
+        return -1;
+    for (uint32_t done = 0; done < len; done += sizeof(buf)) {
+        uint32_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        copy_from_user(buf, addr + done, n);
+        console_write(buf, n);
+    }
+    return len;
+}
+
+// User addresses in a request are checked and bounced like those of the
+// matching syscall (see user_file_io)
+static int32_t io_run(const struct io_sqe *sqe) {
+    char name[SIMPLEFS_MAX_FILENAME];
+
+    switch (sqe->op) {
+        case IO_OP_NOP:
+            return 0;
+        case IO_OP_OPEN:
+            if (copy_string_from_user(name, sqe->addr, sizeof(name)) < 0)
+                return -1;
+            return simplefs_open(name, sqe->len);
+        case IO_OP_CLOSE:
+            return simplefs_close(sqe->fd);
+        case IO_OP_READ:
+            return user_file_io(FILE_IO_READ, sqe->fd, sqe->addr, sqe->len, 0);
+        case IO_OP_WRITE:
+            return user_file_io(FILE_IO_WRITE, sqe->fd, sqe->addr, sqe->len, 0);
+        case IO_OP_PREAD:
+            return user_file_io(FILE_IO_PREAD, sqe->fd, sqe->addr, sqe->len, sqe->off);
+        case IO_OP_PWRITE:
+            return user_file_io(FILE_IO_PWRITE, sqe->fd, sqe->addr, sqe->len, sqe->off);
+        case IO_OP_APPEND:
+            return user_file_io(FILE_IO_APPEND, sqe->fd, sqe->addr, sqe->len, 0);
+        case IO_OP_CONSOLE:
+            return io_console(sqe->addr, sqe->len);
+        default:
+            return -1;
+    }
+}
+
+// Run up to to_submit queued requests, in order, posting a completion for
+// each. Stops early when the submission ring is empty or the completion
+// ring is full; requests left over stay queued for the next call. Returns
+// the number run, or -1 if the process has no ring or its indices make no
+// sense.
+int io_ring_enter(uint32_t to_submit) {
+    struct io_ring *ring = current_proc->io_ring;
+    if (!ring)
+        return -1;
+
+    uint32_t sq_head = ring->sq_head;
+    uint32_t sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t cq_tail = ring->cq_tail;
+    if (sq_tail - sq_head > IO_SQ_ENTRIES)
+        return -1;
+
+    uint32_t done = 0;
+    while (done < to_submit && sq_head != sq_tail &&
+           cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) < IO_CQ_ENTRIES) {
+        // Copied first: the process may rewrite the slot once sq_head passes it
+        struct io_sqe sqe = ring->sq[sq_head % IO_SQ_ENTRIES];
+        __atomic_store_n(&ring->sq_head, ++sq_head, __ATOMIC_RELEASE);
+
+        struct io_cqe *cqe = &ring->cq[cq_tail % IO_CQ_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->res = io_run(&sqe);
+        __atomic_store_n(&ring->cq_tail, ++cq_tail, __ATOMIC_RELEASE);
+        done++;
+    }
+    return done;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+
+// Submission/completion rings shared with a user process. The process
+// queues requests in the submission ring and hands over a batch with one
+// SYS_RING_ENTER; results are posted to the completion ring, which the
+// process reads without entering the kernel. Both rings live in one page
+// that SYS_RING_SETUP maps at USER_IO_RING.
+//
+// Each index only moves forward and is written by one side: sq_tail and
+// cq_head by the process, sq_head and cq_tail by the kernel. Entries are
+// at index % IO_SQ_ENTRIES (or IO_CQ_ENTRIES).
+
+#define IO_SQ_ENTRIES 64
+#define IO_CQ_ENTRIES 128    // Room for two batches of completions
+
+// Operations. Arguments not listed are ignored. res is what the matching
+// syscall or simplefs call returns, -1 on error.
+#define IO_OP_NOP     0
+#define IO_OP_OPEN    1      // addr = path, len = flags
+#define IO_OP_CLOSE   2      // fd
+#define IO_OP_READ    3      // fd, addr, len, at the file position
+#define IO_OP_WRITE   4      // fd, addr, len, at the file position
+#define IO_OP_PREAD   5      // fd, addr, len, off
+#define IO_OP_PWRITE  6      // fd, addr, len, off
+#define IO_OP_APPEND  7      // fd, addr, len
+#define IO_OP_CONSOLE 8      // addr, len: write to the console
+
+struct io_sqe {
+    uint32_t op;
+    int32_t fd;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t off;
+    uint32_t user_data;          // Copied to the completion
+};
+
+struct io_cqe {
+    uint32_t user_data;
+    int32_t res;
+};
+
+struct io_ring {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    struct io_sqe sq[IO_SQ_ENTRIES];
+    struct io_cqe cq[IO_CQ_ENTRIES];
+};
+
+_Static_assert(sizeof(struct io_ring) <= PAGE_SIZE, "io_ring must fit in a page");
+
+uint32_t io_ring_setup(void);
+int io_ring_enter(uint32_t to_submit);
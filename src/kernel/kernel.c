@@ -3,6 +3,17 @@
 #include "simplefs.h"
 #include "vga.h"
 #include "ide.h"
+#include "bcache.h"
+#include "pci.h"
+#include "page_alloc.h"
+#include "slab.h"
+#include "apic.h"
+#include "acpi.h"
+#include "smp.h"
+#include "io_ring.h"
+#include "page_cache.h"
+#include "timer.h"
+#include "serial.h"
 
 extern char __kernel_base[];
 extern char __stack_top[];
@@ -10,23 +21,94 @@ extern char __bss[], __bss_end[];
 extern char __free_ram[], __free_ram_end[];
 
 struct process procs[PROCS_MAX];
-struct process *current_proc;
-struct process *idle_proc;
+struct cpu cpus[CPUS_MAX];
+uint32_t ncpus = 1;
+static struct process boot_proc;             // The kernel_main shell thread
+static struct process idle_procs[CPUS_MAX];  // One per CPU; APs start on its stack
+static struct spinlock procs_lock;           // Claiming and reaping procs[] slots
+uint32_t cpu_features;
 
-// Memory allocation
-paddr_t alloc_pages(uint32_t n) {
-    static paddr_t next_paddr = (paddr_t) __free_ram;
-    paddr_t paddr = next_paddr;
-    next_paddr += n * PAGE_SIZE;
+// x87/SSE registers are per process: saved on every context switch and
+// loaded again by finish_switch(), so a process may also be switched out
+// in the middle of an SSE memcpy. New processes start from fpu_init_state.
+static bool fpu_present;
+static bool fpu_fxsr;            // FXSAVE/FXRSTOR, else FNSAVE/FRSTOR
+static uint8_t fpu_init_state[FPU_STATE_SIZE] __attribute__((aligned(16)));
 
-    if (next_paddr > (paddr_t) __free_ram_end)
-        PANIC("out of memory");
+static void fpu_save(uint8_t *state) {
+    if (fpu_fxsr)
+        __asm__ __volatile__("fxsave (%0)" : : "r"(state) : "memory");
+    else if (fpu_present)
+        __asm__ __volatile__("fnsave (%0)" : : "r"(state) : "memory");  // Also resets the FPU
+}
 
-    memset((void *) paddr, 0, n * PAGE_SIZE);
-    return paddr;
+static void fpu_restore(const uint8_t *state) {
+    if (fpu_fxsr)
+        __asm__ __volatile__("fxrstor (%0)" : : "r"(state) : "memory");
+    else if (fpu_present)
+        __asm__ __volatile__("frstor (%0)" : : "r"(state) : "memory");
+}
+
+// Read the CPUID feature flags and turn on SSE so memcpy/memset can use
+// the SSE2 paths
+static void cpu_init(void) {
+    uint32_t a, b, c;
+    cpuid(1, &a, &b, &c, &cpu_features);
+
+    uint32_t sse = CPUID_FXSR | CPUID_SSE | CPUID_SSE2;
+    if ((cpu_features & sse) == sse) {
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        mem_init(true);
+    }
+
+    fpu_present = (cpu_features & CPUID_FPU) != 0;
+    fpu_fxsr = (cpu_features & CPUID_FXSR) != 0;
+    if (fpu_present) {
+        __asm__ __volatile__("fninit");
+        fpu_save(fpu_init_state);   // Default control words, MXCSR as at reset
+    }
 }
 
 // x86 paging - two-level page tables
+uint32_t *kernel_pd;
+uint32_t kernel_pdes;
+
+// Build the kernel half of the address space once: physical memory up to
+// __free_ram_end is identity-mapped with 4MB pages when the CPU has PSE
+// (with shared 4KB page tables otherwise), and marked global when it has
+// PGE so the TLB entries survive load_cr3(). Every process page directory
+// copies these PDEs instead of building its own tables.
+static void paging_init(void) {
+    bool pse = (cpu_features & CPUID_PSE) != 0;
+    uint32_t global = (cpu_features & CPUID_PGE) ? PAGE_GLOBAL : 0;
+
+    kernel_pdes = align_up((paddr_t) __free_ram_end, LARGE_PAGE_SIZE) / LARGE_PAGE_SIZE;
+    if (kernel_pdes > (USER_BASE >> 22))
+        PANIC("kernel mapping overlaps user space");
+
+    kernel_pd = (uint32_t *) alloc_pages(1);
+    for (uint32_t pde = 0; pde < kernel_pdes; pde++) {
+        paddr_t base = pde * LARGE_PAGE_SIZE;
+        if (pse) {
+            kernel_pd[pde] = base | PAGE_PSE | global | PAGE_WRITE | PAGE_PRESENT;
+        } else {
+            uint32_t *page_table = (uint32_t *) alloc_pages(1);
+            for (int pte = 0; pte < 1024; pte++)
+                page_table[pte] = (base + pte * PAGE_SIZE) | global | PAGE_WRITE | PAGE_PRESENT;
+            kernel_pd[pde] = (paddr_t) page_table | PAGE_WRITE | PAGE_PRESENT;
+        }
+    }
+
+    if (pse)
+        write_cr4(read_cr4() | CR4_PSE);
+    load_cr3((paddr_t) kernel_pd);
+    enable_paging();
+    write_cr0(read_cr0() | CR0_WP);       // Kernel writes to shared pages fault too
+    if (global)
+        write_cr4(read_cr4() | CR4_PGE);  // Only once paging is on
+}
+
 void map_page(uint32_t *page_dir, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     if (!is_aligned(vaddr, PAGE_SIZE))
         PANIC("unaligned vaddr %x", vaddr);
@@ -37,6 +119,10 @@ void map_page(uint32_t *page_dir, uint32_t vaddr, paddr_t paddr, uint32_t flags)
     uint32_t pde_index = vaddr >> 22;
     uint32_t pte_index = (vaddr >> 12) & 0x3ff;
 
+    // The kernel PDEs are shared with every other page directory
+    if (pde_index < kernel_pdes || pde_index >= USER_PDE_END)
+        PANIC("map_page: %x is not a user address", vaddr);
+
     // Check if page table exists
     if ((page_dir[pde_index] & PAGE_PRESENT) == 0) {
         uint32_t pt_paddr = alloc_pages(1);
@@ -47,40 +133,194 @@ void map_page(uint32_t *page_dir, uint32_t vaddr, paddr_t paddr, uint32_t flags)
     page_table[pte_index] = paddr | flags | PAGE_PRESENT;
 }
 
-// Serial port I/O for console
-#define PORT_COM1 0x3f8
+// Map a page of device registers, uncached, at its physical address. It
+// must be above user space. Page directories copy the kernel's PDEs there
+// when they are created, so new 4MB regions must be mapped before any
+// process exists.
+void map_mmio(paddr_t paddr) {
+    uint32_t pde_index = paddr >> 22;
+    if (pde_index < USER_PDE_END)
+        PANIC("map_mmio: %x is below the device region", paddr);
+
+    if (!(kernel_pd[pde_index] & PAGE_PRESENT))
+        kernel_pd[pde_index] = alloc_pages(1) | PAGE_WRITE | PAGE_PRESENT;
+
+    uint32_t *page_table = (uint32_t *) (kernel_pd[pde_index] & ~0xfff);
+    page_table[(paddr >> 12) & 0x3ff] = (paddr & ~0xfff) | PAGE_PCD | PAGE_PWT | PAGE_WRITE | PAGE_PRESENT;
+    invlpg(paddr & ~0xfff);
+}
+
+// A page directory with the kernel and device mappings and no user ones
+static uint32_t *new_page_dir(void) {
+    uint32_t *page_dir = (uint32_t *) alloc_pages(1);
+    memcpy(page_dir, kernel_pd, kernel_pdes * sizeof(uint32_t));
+    memcpy(&page_dir[USER_PDE_END], &kernel_pd[USER_PDE_END],
+           (1024 - USER_PDE_END) * sizeof(uint32_t));
+    return page_dir;
+}
+
+// Page table entry for a user address, or NULL if it has no page table
+static uint32_t *find_pte(uint32_t *page_dir, uint32_t vaddr) {
+    uint32_t pde = page_dir[vaddr >> 22];
+    if (!(pde & PAGE_PRESENT))
+        return NULL;
+    return &((uint32_t *) (pde & ~0xfff))[(vaddr >> 12) & 0x3ff];
+}
+
+// Remove a mapping from the current page directory and return the page it
+// pointed to, or 0 if nothing was mapped there
+static paddr_t unmap_page(uint32_t *page_dir, uint32_t vaddr) {
+    uint32_t *pte = find_pte(page_dir, vaddr);
+    if (!pte || !(*pte & PAGE_PRESENT))
+        return 0;
 
-void serial_init(void) {
-    outb(PORT_COM1 + 1, 0x00);
-    outb(PORT_COM1 + 3, 0x80);
-    outb(PORT_COM1 + 0, 0x03);
-    outb(PORT_COM1 + 1, 0x00);
-    outb(PORT_COM1 + 3, 0x03);
-    outb(PORT_COM1 + 2, 0xC7);
-    outb(PORT_COM1 + 4, 0x0B);
+    paddr_t paddr = *pte & ~0xfff;
+    *pte = 0;
+    invlpg(vaddr);
+    return paddr;
+}
+
+// Console: serial (for QEMU) and VGA (for VirtualBox). Serial output is
+// queued for the UART's interrupt handler, so this doesn't wait for it.
+static struct spinlock console_lock;
+
+// Write a span to the serial port and the screen under one lock hold, so
+// a line printed by one CPU is never interleaved with another's
+void console_write(const char *s, size_t n) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    serial_write(s, n);
+    vga_write(s, n);  // Also display on screen
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void putchar(char ch) {
-    // Send to both serial (for QEMU) and VGA (for VirtualBox)
-    while ((inb(PORT_COM1 + 5) & 0x20) == 0);
-    outb(PORT_COM1, ch);
-    vga_putchar(ch);  // Also display on screen
+    console_write(&ch, 1);
 }
 
+// Serial port input (for QEMU), or -1 if nothing has arrived
 long getchar(void) {
-    // Serial port input (for QEMU)
-    if ((inb(PORT_COM1 + 5) & 1) == 0)
-        return -1;
-    return inb(PORT_COM1);
+    return serial_getc();
+}
+
+// Push out queued console output, for when interrupts can't be relied on
+void console_flush(void) {
+    serial_flush();
 }
 
-// Disk I/O wrapper for SimpleFS
-void read_write_disk(void *buf, unsigned sector, int is_write) {
+// Disk I/O wrapper for SimpleFS (goes through the buffer cache). Returns
+// -1 on a disk error.
+int read_write_disk(void *buf, unsigned sector, int is_write) {
     if (is_write) {
-        ide_write_sector(sector, buf);
-    } else {
-        ide_read_sector(sector, buf);
+        return bcache_write(sector, buf);
+    }
+    return bcache_read(sector, buf);
+}
+
+// Multi-sector variant for contiguous runs (one IDE command per uncached
+// run). Returns -1 on a disk error.
+int read_write_disk_range(void *buf, unsigned sector, unsigned count, int is_write) {
+    if (is_write) {
+        return bcache_write_range(sector, count, buf);
     }
+    return bcache_read_range(sector, count, buf);
+}
+
+// Write ordering barrier for the SimpleFS journal: push every dirty
+// cached sector to the drive, then drain the drive's own write cache.
+// Returns -1 if a sector could not be written.
+int flush_disk(void) {
+    int ret = bcache_sync();
+    ide_flush_cache();
+    return ret;
+}
+
+// Held by every SimpleFS entry point, which covers the buffer cache and
+// the IDE driver under it too
+static struct mutex fs_mutex;
+
+void fs_lock(void) {
+    mutex_lock(&fs_mutex);
+}
+
+void fs_unlock(void) {
+    mutex_unlock(&fs_mutex);
+}
+
+bool fs_lock_held(void) {
+    return fs_mutex.owner == current_proc;
+}
+
+// Owner recorded for SimpleFS descriptors; the kernel shell is pid 0
+int current_pid(void) {
+    return current_proc->pid;
+}
+
+// GDT setup: flat kernel and user segments, plus a TSS per CPU that gives
+// it a kernel stack to switch to when an interrupt arrives in user mode
+struct gdt_entry {
+    uint16_t limit_low;
+    uint16_t base_low;
+    uint8_t base_mid;
+    uint8_t access;
+    uint8_t granularity;         // Limit bits 16-19 and flags
+    uint8_t base_high;
+} __attribute__((packed));
+
+struct gdt_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+struct gdt_entry gdt[5 + CPUS_MAX];
+struct gdt_ptr gdtp;
+
+static void gdt_set_entry(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    gdt[num].limit_low = limit & 0xFFFF;
+    gdt[num].base_low = base & 0xFFFF;
+    gdt[num].base_mid = (base >> 16) & 0xFF;
+    gdt[num].access = access;
+    gdt[num].granularity = ((limit >> 16) & 0x0F) | (flags << 4);
+    gdt[num].base_high = (base >> 24) & 0xFF;
+}
+
+// Build the GDT shared by all CPUs, with every CPU's TSS. SYSENTER and
+// SYSEXIT expect kernel code, kernel data, user code and user data to be
+// consecutive, in that order.
+void gdt_init(void) {
+    gdtp.limit = sizeof(gdt) - 1;
+    gdtp.base = (uint32_t)&gdt;
+
+    gdt_set_entry(0, 0, 0, 0, 0);                     // Null descriptor
+    gdt_set_entry(1, 0, 0xFFFFF, 0x9A, 0xC);          // Kernel code (4KB granularity, 32-bit)
+    gdt_set_entry(2, 0, 0xFFFFF, 0x92, 0xC);          // Kernel data
+    gdt_set_entry(3, 0, 0xFFFFF, 0xFA, 0xC);          // User code (DPL 3)
+    gdt_set_entry(4, 0, 0xFFFFF, 0xF2, 0xC);          // User data (DPL 3)
+
+    for (int i = 0; i < CPUS_MAX; i++) {
+        struct tss *tss = &cpus[i].tss;
+        tss->ss0 = GDT_KERNEL_DATA;
+        tss->iomap_base = sizeof(*tss);  // No I/O permission bitmap
+        gdt_set_entry(5 + i, (uint32_t) tss, sizeof(*tss) - 1, 0x89, 0);  // 32-bit available TSS
+    }
+    cpus[0].tss.esp0 = (uint32_t) __stack_top;
+}
+
+// Load the GDT on the calling CPU, with CPU index's TSS. From then on
+// this_cpu() works there.
+static void gdt_load(uint32_t index) {
+    __asm__ __volatile__(
+        "lgdt (%0)\n"
+        "ljmp $0x08, $1f\n"     // Reload CS
+        "1:\n"
+        "mov $0x10, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%gs\n"
+        "mov %%ax, %%ss\n"
+        "ltr %w1\n"
+        : : "r"(&gdtp), "r"(GDT_TSS + 8 * index) : "eax", "memory"
+    );
 }
 
 // IDT setup
@@ -109,8 +349,52 @@ void idt_set_gate(uint8_t num, uint32_t handler, uint16_t sel, uint8_t flags) {
 }
 
 // Interrupt handlers (assembly stubs will call these)
-extern void isr0(void);
 extern void isr128(void); // Syscall interrupt
+extern void sysenter_entry(void);
+extern const uint8_t syscall_bench_start[], syscall_bench_end[];
+extern void trap_return(void);
+extern void vec48(void), vec49(void), vec255(void);  // Local APIC timer, reschedule and spurious vectors
+extern void exc0(void), exc1(void), exc2(void), exc3(void);
+extern void exc4(void), exc5(void), exc6(void), exc7(void);
+extern void exc8(void), exc9(void), exc10(void), exc11(void);
+extern void exc12(void), exc13(void), exc14(void), exc15(void);
+extern void exc16(void), exc17(void), exc18(void), exc19(void);
+extern void exc20(void), exc21(void), exc22(void), exc23(void);
+extern void exc24(void), exc25(void), exc26(void), exc27(void);
+extern void exc28(void), exc29(void), exc30(void), exc31(void);
+extern void irq0(void), irq1(void), irq2(void), irq3(void);
+extern void irq4(void), irq5(void), irq6(void), irq7(void);
+extern void irq8(void), irq9(void), irq10(void), irq11(void);
+extern void irq12(void), irq13(void), irq14(void), irq15(void);
+
+static void (*const exc_stubs[EXC_COUNT])(void) = {
+    exc0, exc1, exc2, exc3, exc4, exc5, exc6, exc7,
+    exc8, exc9, exc10, exc11, exc12, exc13, exc14, exc15,
+    exc16, exc17, exc18, exc19, exc20, exc21, exc22, exc23,
+    exc24, exc25, exc26, exc27, exc28, exc29, exc30, exc31,
+};
+
+static const char *const exc_names[EXC_COUNT] = {
+    "divide error", "debug", "NMI", "breakpoint",
+    "overflow", "bound range exceeded", "invalid opcode", "device not available",
+    "double fault", "coprocessor segment overrun", "invalid TSS", "segment not present",
+    "stack-segment fault", "general protection fault", "page fault", "reserved",
+    "x87 floating-point error", "alignment check", "machine check", "SIMD floating-point error",
+    "virtualization exception", "control protection exception", "reserved", "reserved",
+    "reserved", "reserved", "reserved", "reserved",
+    "hypervisor injection", "VMM communication", "security exception", "reserved",
+};
+
+static void (*const irq_stubs[IRQ_COUNT])(void) = {
+    irq0, irq1, irq2, irq3, irq4, irq5, irq6, irq7,
+    irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15,
+};
+
+static void (*irq_handlers[IRQ_COUNT])(void);
+
+void irq_register(int irq, void (*handler)(void)) {
+    irq_handlers[irq] = handler;
+}
 
 // PIC (Programmable Interrupt Controller) initialization
 void pic_init(void) {
@@ -124,35 +408,89 @@ void pic_init(void) {
     outb(0x21, 0x01);  // 8086 mode (ICW4)
     outb(0xA1, 0x01);
     
-    // Mask all interrupts (we only use syscalls)
+    // Mask all interrupts; drivers unmask the lines they handle
     outb(0x21, 0xFF);  // Disable all master PIC interrupts
     outb(0xA1, 0xFF);  // Disable all slave PIC interrupts
 }
 
+// Enable a device IRQ. With an I/O APIC it goes to the boot CPU, like
+// it would through the PIC.
+void irq_unmask(int irq) {
+    if (ioapic_available()) {
+        ioapic_route_irq(irq, cpus[0].apic_id);
+        return;
+    }
+    if (irq >= 8) {
+        outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+        irq = IRQ_CASCADE;  // Slave lines also need the cascade open
+    }
+    outb(0x21, inb(0x21) & ~(1 << irq));
+}
+
+static void irq_eoi(int irq) {
+    if (ioapic_available()) {
+        lapic_eoi();
+        return;
+    }
+    if (irq >= 8)
+        outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
+
 void idt_init(void) {
     idtp.limit = (sizeof(struct idt_entry) * 256) - 1;
     idtp.base = (uint32_t)&idt;
 
     memset(&idt, 0, sizeof(struct idt_entry) * 256);
 
+    // CPU exceptions
+    for (int i = 0; i < EXC_COUNT; i++)
+        idt_set_gate(i, (uint32_t)exc_stubs[i], 0x08, 0x8E);
+
     // Set up syscall gate (int 0x80)
     idt_set_gate(128, (uint32_t)isr128, 0x08, 0xEE); // 0xEE = user-level interrupt gate
 
+    // Hardware IRQs (0x8E = kernel-only interrupt gate)
+    for (int i = 0; i < IRQ_COUNT; i++)
+        idt_set_gate(IRQ_BASE + i, (uint32_t)irq_stubs[i], 0x08, 0x8E);
+
+    // Local APIC vectors, used once lapic_init() finds one
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint32_t)vec48, 0x08, 0x8E);
+    idt_set_gate(LAPIC_RESCHED_VECTOR, (uint32_t)vec49, 0x08, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)vec255, 0x08, 0x8E);
+
     load_idt(&idtp);
     pic_init();  // Initialize PIC
 }
 
+// sysenter_entry finds the kernel stack at this offset into the TSS
+_Static_assert(offsetof(struct tss, esp0) == 4, "sysenter_entry expects esp0 at offset 4");
+
+bool sysenter_enabled;
+
+// Point SYSENTER at sysenter_entry on the calling CPU. It arrives with no
+// stack of its own, so MSR_SYSENTER_ESP points at the CPU's TSS, whose
+// esp0 is the running process's kernel stack.
+static void sysenter_init(uint32_t index) {
+    if (!(cpu_features & CPUID_SEP))
+        return;
+    wrmsr(MSR_SYSENTER_CS, GDT_KERNEL_CODE);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t) &cpus[index].tss);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+    sysenter_enabled = true;
+}
+
 // Process management
 __attribute__((naked)) void user_entry(void) {
     __asm__ __volatile__(
+        "call finish_switch\n"
         "mov $0x23, %%ax\n"      // User data segment
         "mov %%ax, %%ds\n"
         "mov %%ax, %%es\n"
         "mov %%ax, %%fs\n"
         "mov %%ax, %%gs\n"
-        "mov %%esp, %%eax\n"
         "pushl $0x23\n"          // SS
-        "pushl %%eax\n"          // ESP
+        "pushl %1\n"             // ESP (user stack, mapped on first touch)
         "pushf\n"                // EFLAGS
         "popl %%eax\n"
         "orl $0x200, %%eax\n"    // Enable interrupts
@@ -160,7 +498,16 @@ __attribute__((naked)) void user_entry(void) {
         "pushl $0x1B\n"          // CS (user code segment)
         "pushl %0\n"             // EIP
         "iret\n"
-        : : "r"(USER_BASE)
+        : : "i"(USER_BASE), "i"(USER_STACK_TOP)
+    );
+}
+
+// Where a forked child starts: return to user mode through the copy of
+// its parent's trap frame
+__attribute__((naked)) static void fork_return(void) {
+    __asm__ __volatile__(
+        "call finish_switch\n"
+        "jmp trap_return\n"
     );
 }
 
@@ -170,6 +517,8 @@ __attribute__((naked)) void switch_context(uint32_t *prev_sp, uint32_t *next_sp)
         "pushl %%ebx\n"
         "pushl %%esi\n"
         "pushl %%edi\n"
+        "movl 20(%%esp), %%eax\n"  // prev_sp
+        "movl 24(%%esp), %%edx\n"  // next_sp
         "movl %%esp, (%%eax)\n"
         "movl (%%edx), %%esp\n"
         "popl %%edi\n"
@@ -181,106 +530,1107 @@ __attribute__((naked)) void switch_context(uint32_t *prev_sp, uint32_t *next_sp)
     );
 }
 
-struct process *create_process(const void *image, size_t image_size) {
+// Run queues: each CPU has a FIFO per priority (0 is the highest) and a
+// bitmap of the non-empty ones, so picking the next process is one bit
+// scan however many processes there are. A process is queued while it is
+// runnable but not running, on the queue of the CPU it last ran on. Idle
+// CPUs steal from the others. Callers hold the queue's rq_lock.
+static void rq_push(struct cpu *cpu, struct process *proc) {
+    uint32_t prio = proc->priority;
+    proc->run_next = NULL;
+    if (cpu->rq_tail[prio])
+        cpu->rq_tail[prio]->run_next = proc;
+    else
+        cpu->rq_head[prio] = proc;
+    cpu->rq_tail[prio] = proc;
+    cpu->rq_bitmap |= 1u << prio;
+    cpu->rq_count++;
+}
+
+// Dequeue the first process of priority max_prio or better and claim it
+// for the calling CPU. Processes still being switched away from on
+// another CPU are passed over.
+static struct process *rq_pick(struct cpu *cpu, uint32_t max_prio) {
+    uint32_t bitmap = cpu->rq_bitmap & (0xFFFFFFFFu >> (31 - max_prio));
+    while (bitmap) {
+        uint32_t prio = __builtin_ctz(bitmap);
+        bitmap &= ~(1u << prio);
+
+        struct process *prev = NULL;
+        for (struct process *proc = cpu->rq_head[prio]; proc; prev = proc, proc = proc->run_next) {
+            if (proc->on_cpu)
+                continue;
+            if (prev)
+                prev->run_next = proc->run_next;
+            else
+                cpu->rq_head[prio] = proc->run_next;
+            if (cpu->rq_tail[prio] == proc)
+                cpu->rq_tail[prio] = prev;
+            if (!cpu->rq_head[prio])
+                cpu->rq_bitmap &= ~(1u << prio);
+            cpu->rq_count--;
+            proc->on_cpu = true;
+            return proc;
+        }
+    }
+    return NULL;
+}
+
+// Caller holds proc->lock. A process still on a CPU is not queued: that
+// CPU sees the new state in yield() and keeps running it. Another CPU
+// that should switch to it gets a reschedule IPI rather than waiting for
+// its next tick.
+static void make_runnable(struct process *proc) {
+    proc->state = PROC_RUNNABLE;
+    if (proc->on_cpu)
+        return;
+
+    struct cpu *cpu = &cpus[proc->cpu];
+    bool preempt = false;
+    spin_lock(&cpu->rq_lock);
+    rq_push(cpu, proc);
+    if (proc->priority < cpu->current->priority) {
+        cpu->need_resched = true;
+        preempt = true;
+    }
+    spin_unlock(&cpu->rq_lock);
+
+    if (preempt && cpu != this_cpu())
+        lapic_send_ipi(cpu->apic_id, LAPIC_RESCHED_VECTOR);
+}
+
+// Queue a new process, spreading them over the CPUs round robin
+static void start_process(struct process *proc) {
+    static uint32_t next_cpu;
+    proc->cpu = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) % ncpus;
+
+    uint32_t flags = spin_lock_irqsave(&proc->lock);
+    make_runnable(proc);
+    spin_unlock_irqrestore(&proc->lock, flags);
+}
+
+// Drop every user mapping in a page directory and free the page tables.
+// Pages shared with another process by fork stay until it drops them too.
+// The shared kernel PDEs are skipped.
+static void free_user_space(uint32_t *page_dir) {
+    for (uint32_t pde = kernel_pdes; pde < USER_PDE_END; pde++) {
+        if (!(page_dir[pde] & PAGE_PRESENT))
+            continue;
+        uint32_t *page_table = (uint32_t *) (page_dir[pde] & ~0xfff);
+        for (int pte = 0; pte < 1024; pte++) {
+            if (page_table[pte] & PAGE_PRESENT)
+                page_put(page_table[pte] & ~0xfff);
+        }
+        free_pages((paddr_t) page_table, 1);
+        page_dir[pde] = 0;
+    }
+}
+
+static void image_put(struct user_image *img) {
+    if (img && __atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        kfree(img);
+}
+
+// Read a program from a file for exec
+static struct user_image *load_image(const char *filename) {
+    int fd = simplefs_open(filename, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct user_image *img = NULL;
+    int size = simplefs_seek(fd, 0, SIMPLEFS_SEEK_END);
+    if (size > 0 && sizeof(*img) + size <= (PAGE_SIZE << PAGE_MAX_ORDER)) {
+        img = kmalloc(sizeof(*img) + size);
+        img->refs = 1;
+        img->size = size;
+        if (simplefs_pread(fd, img->data, size, 0) != size) {
+            kfree(img);
+            img = NULL;
+        }
+    }
+    simplefs_close(fd);
+    return img;
+}
+
+// Give back everything an exited process allocated: its user pages, their
+// page tables, the directory and its image. Caller holds procs_lock.
+static void reap_process(struct process *proc) {
+    free_user_space(proc->page_table);
+    free_pages((paddr_t) proc->page_table, 1);
+    image_put(proc->image_ref);
+
+    proc->image_ref = NULL;
+    proc->page_table = NULL;
+    proc->state = PROC_UNUSED;
+}
+
+// A process can't be reaped until its CPU has switched off its stack
+static bool reapable(struct process *proc) {
+    return proc->state == PROC_EXITED && !proc->on_cpu;
+}
+
+static void reap_exited(void) {
+    uint32_t flags = spin_lock_irqsave(&procs_lock);
+    for (int i = 0; i < PROCS_MAX; i++) {
+        if (reapable(&procs[i]))
+            reap_process(&procs[i]);
+    }
+    spin_unlock_irqrestore(&procs_lock, flags);
+}
+
+static long getchar_blocking(void) {
+    long ch;
+    while ((ch = getchar()) < 0)
+        serial_wait_input();
+    return ch;
+}
+
+// Background work for when the shell is waiting for input: reap exited
+// processes and, while no one else wants the CPU, zero free pages. Then
+// sleep until input arrives.
+static void kernel_idle(void) {
+    reap_exited();
+    if (!this_cpu()->rq_count && page_zero_idle(16) > 0)
+        return;
+    serial_wait_input();
+}
+
+// Find a free process slot, reaping exited processes on the way. The slot
+// is claimed as blocked until the caller starts it.
+static struct process *alloc_proc(void) {
     struct process *proc = NULL;
-    int i;
-    for (i = 0; i < PROCS_MAX; i++) {
+    uint32_t flags = spin_lock_irqsave(&procs_lock);
+    for (int i = 0; i < PROCS_MAX && !proc; i++) {
+        if (reapable(&procs[i]))
+            reap_process(&procs[i]);
         if (procs[i].state == PROC_UNUSED) {
             proc = &procs[i];
-            break;
+            proc->pid = i + 1;
+            proc->priority = PRIO_DEFAULT;
+            proc->io_ring = NULL;
+            memcpy(proc->fpu, fpu_init_state, FPU_STATE_SIZE);
+            memset(proc->mmaps, 0, sizeof(proc->mmaps));
+            proc->state = PROC_BLOCKED;
         }
     }
+    spin_unlock_irqrestore(&procs_lock, flags);
+    return proc;
+}
+
+// Point a process at a new program: nothing is mapped yet, and the heap
+// starts empty right after the image
+static void set_image(struct process *proc, const void *image, size_t image_size) {
+    proc->image = image;
+    proc->image_size = image_size;
+    proc->heap_start = align_up(USER_BASE + image_size, PAGE_SIZE);
+    proc->brk = proc->heap_start;
+}
 
+// The image is not copied here: its pages are copied in by the page-fault
+// handler as the process touches them, so it must stay around for as long
+// as the process does
+struct process *create_process(const void *image, size_t image_size) {
+    struct process *proc = alloc_proc();
     if (!proc)
-        PANIC("no free process slots");
+        return NULL;
 
+    // Popped by switch_context
     uint32_t *sp = (uint32_t *) &proc->stack[sizeof(proc->stack)];
-    *--sp = 0;  // edi
-    *--sp = 0;  // esi
-    *--sp = 0;  // ebx
-    *--sp = 0;  // ebp
     *--sp = (uint32_t) user_entry;  // return address
+    *--sp = 0;  // ebp
+    *--sp = 0;  // ebx
+    *--sp = 0;  // esi
+    *--sp = 0;  // edi
 
-    // Create page directory
-    uint32_t *page_dir = (uint32_t *) alloc_pages(1);
-
-    // Map kernel pages
-    for (paddr_t paddr = (paddr_t) __kernel_base;
-         paddr < (paddr_t) __free_ram_end; paddr += PAGE_SIZE)
-        map_page(page_dir, paddr, paddr, PAGE_WRITE);
-
-    // Map user pages
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        paddr_t page = alloc_pages(1);
-        size_t remaining = image_size - off;
-        size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
-        memcpy((void *) page, image + off, copy_size);
-        map_page(page_dir, USER_BASE + off, page, PAGE_USER | PAGE_WRITE);
-    }
+    // Create page directory; the kernel half is shared
+    uint32_t *page_dir = new_page_dir();
 
-    proc->pid = i + 1;
-    proc->state = PROC_RUNNABLE;
+    set_image(proc, image, image_size);
+    proc->image_ref = NULL;
     proc->sp = (uint32_t) sp;
     proc->page_table = page_dir;
+    start_process(proc);
     return proc;
 }
 
-void yield(void) {
-    struct process *next = idle_proc;
-    for (int i = 0; i < PROCS_MAX; i++) {
-        struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-            next = proc;
-            break;
-        }
+// Next process for cpu: the best queued one that should run instead of
+// prev, or, if prev can't run and the local queue is empty, one stolen
+// from the CPU with the most queued processes. NULL if there is none.
+static struct process *pick_next(struct cpu *cpu, struct process *prev, bool runnable) {
+    spin_lock(&cpu->rq_lock);
+    struct process *next = rq_pick(cpu, runnable ? prev->priority : PRIO_LEVELS - 1);
+    spin_unlock(&cpu->rq_lock);
+    if (next || runnable)
+        return next;
+
+    struct cpu *busiest = NULL;
+    for (uint32_t i = 0; i < ncpus; i++) {
+        if (&cpus[i] != cpu && cpus[i].rq_count && (!busiest || cpus[i].rq_count > busiest->rq_count))
+            busiest = &cpus[i];
     }
+    if (!busiest)
+        return NULL;
+
+    spin_lock(&busiest->rq_lock);
+    next = rq_pick(busiest, PRIO_LEVELS - 1);
+    spin_unlock(&busiest->rq_lock);
+    if (next)
+        cpu->steals++;
+    return next;
+}
+
+// Switch to the highest-priority runnable process, round robin within a
+// priority. The current process keeps the CPU if it is still runnable and
+// nothing of the same or higher priority is queued here. A CPU with
+// nothing to run switches to its idle thread.
+void yield(void) {
+    uint32_t flags = irq_save();
+    struct cpu *cpu = this_cpu();
+    struct process *prev = cpu->current;
+    cpu->need_resched = false;
+    cpu->slice_left = TIME_SLICE_TICKS;
 
-    if (next == current_proc)
+    // Held until finish_switch(), so that a wake-up on another CPU waits
+    // until prev is off this CPU's stack
+    spin_lock(&prev->lock);
+    bool runnable = prev->state == PROC_RUNNABLE && prev != cpu->idle;
+    struct process *next = pick_next(cpu, prev, runnable);
+    if (!next)
+        next = runnable ? prev : cpu->idle;
+    if (next == prev) {
+        spin_unlock(&prev->lock);
+        irq_restore(flags);
         return;
+    }
 
-    struct process *prev = current_proc;
-    current_proc = next;
+    if (runnable) {
+        spin_lock(&cpu->rq_lock);
+        rq_push(cpu, prev);
+        spin_unlock(&cpu->rq_lock);
+    }
+    next->on_cpu = true;
+    next->cpu = cpu->id;
+    cpu->current = next;
+    cpu->prev = prev;
+    cpu->switches++;
 
-    load_cr3((uint32_t)next->page_table);
+    cpu->tss.esp0 = (uint32_t) &next->stack[sizeof(next->stack)];
+    if (next->page_table != prev->page_table)
+        load_cr3((uint32_t) next->page_table);
+    fpu_save(prev->fpu);
     switch_context(&prev->sp, &next->sp);
+    finish_switch();
+    irq_restore(flags);
 }
 
-void handle_syscall(struct trap_frame *f) {
-    switch (f->eax) {
-        case SYS_PUTCHAR:
-            putchar(f->ebx);
-            break;
-        case SYS_GETCHAR:
-            while (1) {
-                long ch = getchar();
-                if (ch >= 0) {
-                    f->ebx = ch;
-                    break;
-                }
-                yield();
-            }
+// Second half of a context switch, run by the process switched to (which
+// may now be on a different CPU than the one it left): load its FPU
+// registers and release the one this CPU switched away from
+void finish_switch(void) {
+    struct cpu *cpu = this_cpu();
+    fpu_restore(cpu->current->fpu);
+    struct process *prev = cpu->prev;
+    prev->on_cpu = false;
+    spin_unlock(&prev->lock);
+}
+
+// Timer tick: when the running process has used up its time slice, ask
+// for it to be preempted on the way out of the interrupt
+void scheduler_tick(void) {
+    struct cpu *cpu = this_cpu();
+    if (cpu->current == cpu->idle)
+        cpu->idle_ticks++;
+    else
+        cpu->busy_ticks++;
+    if (--cpu->slice_left <= 0)
+        cpu->need_resched = true;
+}
+
+// What a CPU runs when it has nothing else to: look for work, then halt
+// until the next interrupt. Processes queued here by other CPUs come with
+// a reschedule IPI; work left for stealing is noticed at the latest on
+// the next timer tick.
+static __attribute__((noreturn)) void idle_loop(void) {
+    while (1) {
+        cli();
+        yield();
+        __asm__ __volatile__("sti\n hlt");
+    }
+}
+
+// The boot CPU's idle thread starts here the first time it is switched to
+static void idle_thread(void) {
+    finish_switch();
+    idle_loop();
+}
+
+// Set up a CPU's entry in cpus[] and its idle thread
+void cpu_prepare(uint32_t index, uint32_t apic_id) {
+    struct cpu *cpu = &cpus[index];
+    struct process *idle = &idle_procs[index];
+    cpu->id = index;
+    cpu->apic_id = apic_id;
+    cpu->idle = idle;
+    cpu->current = idle;
+    cpu->slice_left = TIME_SLICE_TICKS;
+
+    idle->state = PROC_RUNNABLE;
+    idle->priority = PRIO_LEVELS;   // Below every real priority
+    idle->page_table = kernel_pd;
+    idle->cpu = index;
+    memcpy(idle->fpu, fpu_init_state, FPU_STATE_SIZE);
+
+    // Popped by switch_context. APs instead start on this stack in ap_main().
+    uint32_t *sp = (uint32_t *) &idle->stack[sizeof(idle->stack)];
+    *--sp = 0;                        // idle_thread's return address
+    *--sp = (uint32_t) idle_thread;   // return address
+    *--sp = 0;  // ebp
+    *--sp = 0;  // ebx
+    *--sp = 0;  // esi
+    *--sp = 0;  // edi
+    idle->sp = (uint32_t) sp;
+}
+
+// Entry point of the application processors, called by the trampoline
+// (ap_trampoline in boot.s) on their idle thread's stack
+void ap_main(uint32_t index) {
+    gdt_load(index);
+    sysenter_init(index);
+    load_idt(&idtp);
+    lapic_init_ap();
+    timer_init_ap();
+    cpus[index].started = true;
+    idle_loop();
+}
+
+// Block the current process until wake_up() is called on wq. The caller
+// holds wq->lock with interrupts off, having just seen that what it waits
+// for hasn't happened yet, so a wake-up can't slip in between. The lock
+// is dropped while asleep and held again on return.
+void sleep_on_locked(struct wait_queue *wq) {
+    struct process *proc = current_proc;
+    spin_lock(&proc->lock);
+    proc->state = PROC_BLOCKED;
+    spin_unlock(&proc->lock);
+    proc->wait_next = wq->head;
+    wq->head = proc;
+
+    spin_unlock(&wq->lock);
+    yield();
+    spin_lock(&wq->lock);
+}
+
+// Block the current process until wake_up() is called on wq. Other
+// processes run meanwhile.
+void sleep_on(struct wait_queue *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    sleep_on_locked(wq);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Make every process sleeping on wq runnable again
+void wake_up(struct wait_queue *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+
+    struct process *proc = wq->head;
+    wq->head = NULL;
+    while (proc) {
+        struct process *next = proc->wait_next;
+        proc->wait_next = NULL;
+        spin_lock(&proc->lock);
+        if (proc->state == PROC_BLOCKED)
+            make_runnable(proc);
+        spin_unlock(&proc->lock);
+        proc = next;
+    }
+
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void mutex_lock(struct mutex *m) {
+    uint32_t flags = spin_lock_irqsave(&m->wq.lock);
+    while (m->owner)
+        sleep_on_locked(&m->wq);
+    m->owner = current_proc;
+    spin_unlock_irqrestore(&m->wq.lock, flags);
+}
+
+void mutex_unlock(struct mutex *m) {
+    uint32_t flags = spin_lock_irqsave(&m->wq.lock);
+    m->owner = NULL;
+    spin_unlock_irqrestore(&m->wq.lock, flags);
+    wake_up(&m->wq);
+}
+
+// Move the end of the heap by increment bytes and return the old end, or
+// -1 if that would leave the heap region. Growing only moves the break;
+// the new pages are mapped when first touched.
+static uint32_t sys_sbrk(int32_t increment) {
+    struct process *proc = current_proc;
+    uint32_t old_brk = proc->brk;
+    uint32_t new_brk = old_brk + increment;
+
+    if (increment >= 0 && (new_brk < old_brk || new_brk > USER_HEAP_MAX))
+        return -1;
+    if (increment < 0 && (new_brk > old_brk || new_brk < proc->heap_start))
+        return -1;
+
+    // Shrinking gives back the pages wholly above the new break
+    for (uint32_t vaddr = align_up(new_brk, PAGE_SIZE); vaddr < align_up(old_brk, PAGE_SIZE);
+         vaddr += PAGE_SIZE) {
+        paddr_t page = unmap_page(proc->page_table, vaddr);
+        if (page)
+            page_put(page);
+    }
+
+    proc->brk = new_brk;
+    return old_brk;
+}
+
+// Duplicate the current process. User pages are not copied: parent and
+// child both map them read-only, and the first write to one takes a
+// private copy (see cow_fault). The child returns 0, the parent its pid.
+static int sys_fork(struct trap_frame *f) {
+    struct process *parent = current_proc;
+    struct process *child = alloc_proc();
+    if (!child)
+        return -1;
+
+    uint32_t *page_dir = new_page_dir();
+    for (uint32_t pde = kernel_pdes; pde < USER_PDE_END; pde++) {
+        if (!(parent->page_table[pde] & PAGE_PRESENT))
+            continue;
+        uint32_t *src = (uint32_t *) (parent->page_table[pde] & ~0xfff);
+        uint32_t *dst = (uint32_t *) alloc_pages(1);
+        for (int pte = 0; pte < 1024; pte++) {
+            if (!(src[pte] & PAGE_PRESENT) || (src[pte] & PAGE_NOFORK))
+                continue;
+            if ((src[pte] & (PAGE_WRITE | PAGE_SHARED)) == PAGE_WRITE)
+                src[pte] = (src[pte] & ~PAGE_WRITE) | PAGE_COW;
+            dst[pte] = src[pte];
+            page_get(src[pte] & ~0xfff);
+        }
+        page_dir[pde] = (paddr_t) dst | (parent->page_table[pde] & 0xfff);
+    }
+    load_cr3((uint32_t) parent->page_table);  // Flush the parent's writable TLB entries
+
+    // The child resumes in trap_return with a copy of the parent's frame
+    uint32_t *sp = (uint32_t *) &child->stack[sizeof(child->stack) - sizeof(*f)];
+    struct trap_frame *frame = (struct trap_frame *) sp;
+    *frame = *f;
+    frame->ebx = 0;
+    *--sp = (uint32_t) fork_return;  // return address
+    *--sp = 0;  // ebp
+    *--sp = 0;  // ebx
+    *--sp = 0;  // esi
+    *--sp = 0;  // edi
+
+    set_image(child, parent->image, parent->image_size);
+    child->brk = parent->brk;
+    child->image_ref = parent->image_ref;
+    if (child->image_ref)
+        __atomic_add_fetch(&child->image_ref->refs, 1, __ATOMIC_RELAXED);
+    memcpy(child->mmaps, parent->mmaps, sizeof(child->mmaps));
+    fpu_save(child->fpu);       // The parent's registers as of the syscall
+    fpu_restore(child->fpu);    // FNSAVE reset them
+    child->page_table = page_dir;
+    child->sp = (uint32_t) sp;
+    child->priority = parent->priority;
+    start_process(child);
+    return child->pid;
+}
+
+// mmap(): files mapped into a process. Pages come from the page cache
+// and are shared with every other process mapping them; a forked child
+// shares them too. Writes reach the file on msync, munmap or exit.
+
+static struct mmap_area *find_mmap(struct process *proc, uint32_t vaddr) {
+    for (int i = 0; i < PROC_MMAPS_MAX; i++) {
+        struct mmap_area *area = &proc->mmaps[i];
+        if (area->pages && vaddr >= area->start && vaddr - area->start < area->pages * PAGE_SIZE)
+            return area;
+    }
+    return NULL;
+}
+
+// Lowest free range of pages pages in the mmap region, or 0
+static uint32_t mmap_place(struct process *proc, uint32_t pages) {
+    uint32_t start = USER_MMAP_BASE;
+    for (int i = 0; i < PROC_MMAPS_MAX; i++) {
+        struct mmap_area *area = &proc->mmaps[i];
+        if (area->pages && start < area->start + area->pages * PAGE_SIZE &&
+            area->start < start + pages * PAGE_SIZE) {
+            start = area->start + area->pages * PAGE_SIZE;
+            i = -1;  // Check the moved range against every area again
+        }
+    }
+    if (pages > (USER_IO_RING - start) / PAGE_SIZE)
+        return 0;
+    return start;
+}
+
+// Map length bytes of an open file from offset off, which must be page
+// aligned. Nothing is read yet: pages are mapped by the page-fault handler
+// as they are touched, and touching one wholly past the end of the file,
+// or after the file has been deleted, kills the process. Returns the
+// address, or -1.
+static uint32_t sys_mmap(int fd, uint32_t length, uint32_t off) {
+    struct process *proc = current_proc;
+    uint32_t gen;
+    int ino = simplefs_fd_ino(fd, &gen);
+    if (ino < 0 || length == 0 || !is_aligned(off, PAGE_SIZE) ||
+        length > USER_IO_RING - USER_MMAP_BASE)
+        return -1;
+
+    struct mmap_area *area = NULL;
+    for (int i = 0; i < PROC_MMAPS_MAX && !area; i++) {
+        if (!proc->mmaps[i].pages)
+            area = &proc->mmaps[i];
+    }
+    uint32_t pages = align_up(length, PAGE_SIZE) / PAGE_SIZE;
+    uint32_t start = area ? mmap_place(proc, pages) : 0;
+    if (!start)
+        return -1;
+
+    area->start = start;
+    area->pages = pages;
+    area->ino = ino;
+    area->gen = gen;
+    area->first = off / PAGE_SIZE;
+    return start;
+}
+
+static bool mmap_fault(struct process *proc, struct mmap_area *area, uint32_t vaddr) {
+    uint32_t page_vaddr = vaddr & ~(PAGE_SIZE - 1);
+    paddr_t page = page_cache_get(area->ino, area->gen,
+                                  area->first + (page_vaddr - area->start) / PAGE_SIZE);
+    if (!page)
+        return false;
+    map_page(proc->page_table, page_vaddr, page, PAGE_USER | PAGE_WRITE | PAGE_SHARED);
+    return true;
+}
+
+// Write back the pages of an area in [start, end) that were written since
+// the last sync, going by their dirty bits. proc's address space is the
+// loaded one.
+static void mmap_sync(struct process *proc, struct mmap_area *area, uint32_t start, uint32_t end) {
+    uint32_t area_end = area->start + area->pages * PAGE_SIZE;
+    if (start < area->start)
+        start = area->start;
+    if (end > area_end)
+        end = area_end;
+
+    for (uint32_t vaddr = start & ~(PAGE_SIZE - 1); vaddr < end; vaddr += PAGE_SIZE) {
+        uint32_t *pte = find_pte(proc->page_table, vaddr);
+        if (!pte || (*pte & (PAGE_PRESENT | PAGE_DIRTY)) != (PAGE_PRESENT | PAGE_DIRTY))
+            continue;
+        *pte &= ~PAGE_DIRTY;
+        invlpg(vaddr);
+        page_cache_writeback(area->ino, area->gen, area->first + (vaddr - area->start) / PAGE_SIZE,
+                             *pte & ~0xfff);
+    }
+}
+
+// Write back what was written through any mapping in [addr, addr + length)
+static int sys_msync(uint32_t addr, uint32_t length) {
+    struct process *proc = current_proc;
+    if (addr + length < addr)
+        return -1;
+    for (int i = 0; i < PROC_MMAPS_MAX; i++) {
+        if (proc->mmaps[i].pages)
+            mmap_sync(proc, &proc->mmaps[i], addr, addr + length);
+    }
+    return 0;
+}
+
+// Write back and remove the whole mapping that starts at addr
+static int sys_munmap(uint32_t addr) {
+    struct process *proc = current_proc;
+    struct mmap_area *area = find_mmap(proc, addr);
+    if (!area || area->start != addr)
+        return -1;
+
+    uint32_t end = area->start + area->pages * PAGE_SIZE;
+    mmap_sync(proc, area, area->start, end);
+    for (uint32_t vaddr = area->start; vaddr < end; vaddr += PAGE_SIZE) {
+        paddr_t page = unmap_page(proc->page_table, vaddr);
+        if (page)
+            page_put(page);
+    }
+    area->pages = 0;
+    return 0;
+}
+
+// Write back every mapping of a process whose address space is going
+// away (exit or exec); its pages go with the rest of it
+static void mmap_release_all(struct process *proc) {
+    for (int i = 0; i < PROC_MMAPS_MAX; i++) {
+        struct mmap_area *area = &proc->mmaps[i];
+        if (area->pages)
+            mmap_sync(proc, area, area->start, area->start + area->pages * PAGE_SIZE);
+        area->pages = 0;
+    }
+}
+
+// Replace the current program with the one in a file. The old mappings
+// and open files are dropped and the new image is paged in on demand
+// like any other.
+// Returns -1 if the file can't be loaded; otherwise the syscall returns
+// to the start of the new program.
+static int sys_exec(struct trap_frame *f, const char *filename) {
+    struct user_image *img = load_image(filename);
+    if (!img)
+        return -1;
+
+    struct process *proc = current_proc;
+    mmap_release_all(proc);
+    simplefs_close_all(proc->pid);
+    free_user_space(proc->page_table);
+    load_cr3((uint32_t) proc->page_table);
+    image_put(proc->image_ref);
+    set_image(proc, img->data, img->size);
+    proc->image_ref = img;
+    proc->io_ring = NULL;   // Its page went with the old mappings
+    fpu_restore(fpu_init_state);
+
+    f->edi = f->esi = f->ebp = f->ebx = f->edx = f->ecx = f->eax = 0;
+    f->eip = USER_BASE;
+    f->user_esp = USER_STACK_TOP;
+    return 0;
+}
+
+// Set the current process's priority, 0 being the highest. Returns the
+// old one, or -1 if prio is out of range.
+static int sys_setprio(uint32_t prio) {
+    if (prio >= PRIO_LEVELS)
+        return -1;
+    int old = current_proc->priority;
+    current_proc->priority = prio;
+    this_cpu()->need_resched = true;  // Someone else may come first now
+    return old;
+}
+
+// Stop the current process for good; it is reaped once its CPU has
+// switched away (see reapable)
+static __attribute__((noreturn)) void exit_current(void) {
+    struct process *proc = current_proc;
+    mmap_release_all(proc);
+    simplefs_close_all(proc->pid);
+    uint32_t flags = spin_lock_irqsave(&proc->lock);
+    proc->state = PROC_EXITED;
+    spin_unlock_irqrestore(&proc->lock, flags);
+    yield();
+    PANIC("exited process %d was scheduled", proc->pid);
+}
+
+// True if [addr, addr + len) lies in the user part of the address space
+bool user_range_ok(uint32_t addr, uint32_t len) {
+    return addr >= USER_BASE && addr <= USER_STACK_TOP && len <= USER_STACK_TOP - addr;
+}
+
+// Copy between kernel and user memory. Returns -1, copying nothing, if the
+// range is outside user space. Pages not mapped yet are faulted in; a
+// fault that can't be resolved kills the process, so callers must not hold
+// any lock.
+int copy_from_user(void *dst, uint32_t src, size_t len) {
+    if (!user_range_ok(src, len))
+        return -1;
+    memcpy(dst, (const void *) src, len);
+    return 0;
+}
+
+int copy_to_user(uint32_t dst, const void *src, size_t len) {
+    if (!user_range_ok(dst, len))
+        return -1;
+    memcpy((void *) dst, src, len);
+    return 0;
+}
+
+// Copy a NUL-terminated string into a buffer of size bytes. Returns its
+// length, or -1 if it leaves user memory or doesn't fit.
+int copy_string_from_user(char *dst, uint32_t src, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (!user_range_ok(src + i, 1))
+            return -1;
+        dst[i] = *(const char *) (src + i);
+        if (!dst[i])
+            return i;
+    }
+    return -1;
+}
+
+// A SimpleFS read or write on a user buffer. The data goes through the
+// process's bounce page a page at a time, so SimpleFS and the disk driver
+// only ever see kernel memory and user memory is touched with the fs lock
+// released. Returns the bytes moved, or the simplefs error if the first
+// chunk fails.
+int user_file_io(int op, int fd, uint32_t addr, uint32_t len, uint32_t off) {
+    if (!user_range_ok(addr, len))
+        return -1;
+
+    uint8_t *bounce = current_proc->bounce;
+    bool is_write = op != FILE_IO_READ && op != FILE_IO_PREAD;
+    int done = 0;
+
+    do {
+        uint32_t n = len < PAGE_SIZE ? len : PAGE_SIZE;
+        if (is_write)
+            copy_from_user(bounce, addr, n);
+
+        int ret;
+        switch (op) {
+            case FILE_IO_READ:   ret = simplefs_fread(fd, bounce, n); break;
+            case FILE_IO_WRITE:  ret = simplefs_fwrite(fd, bounce, n); break;
+            case FILE_IO_APPEND: ret = simplefs_append(fd, bounce, n); break;
+            case FILE_IO_PREAD:  ret = simplefs_pread(fd, bounce, n, off); break;
+            case FILE_IO_PWRITE: ret = simplefs_pwrite(fd, bounce, n, off); break;
+            default: return -1;
+        }
+        if (ret < 0)
+            return done > 0 ? done : ret;
+        if (!is_write)
+            copy_to_user(addr, bounce, ret);
+
+        done += ret;
+        if ((uint32_t) ret < n)
             break;
-        case SYS_EXIT:
-            printf("process %d exited\n", current_proc->pid);
-            current_proc->state = PROC_EXITED;
-            yield();
-            PANIC("unreachable");
-        default:
-            PANIC("unexpected syscall eax=%x\n", f->eax);
+        addr += n;
+        off += n;
+        len -= n;
+    } while (len > 0);
+    return done;
+}
+
+// System call handlers. Arguments come in ebx, ecx, edx, esi and the
+// result goes back in ebx. User pointers are only dereferenced through the
+// copy helpers above.
+static void syscall_putchar(struct trap_frame *f) {
+    putchar(f->ebx);
+}
+
+static void syscall_getchar(struct trap_frame *f) {
+    f->ebx = getchar_blocking();
+}
+
+static void syscall_exit(struct trap_frame *f) {
+    (void) f;
+    printf("process %d exited\n", current_proc->pid);
+    exit_current();
+}
+
+static void syscall_open(struct trap_frame *f) {
+    char name[SIMPLEFS_MAX_FILENAME];
+    if (copy_string_from_user(name, f->ebx, sizeof(name)) < 0)
+        f->ebx = -1;
+    else
+        f->ebx = simplefs_open(name, f->ecx);
+}
+
+static void syscall_close(struct trap_frame *f) {
+    f->ebx = simplefs_close(f->ebx);
+}
+
+static void syscall_readf(struct trap_frame *f) {
+    f->ebx = user_file_io(FILE_IO_READ, f->ebx, f->ecx, f->edx, 0);
+}
+
+static void syscall_writef(struct trap_frame *f) {
+    f->ebx = user_file_io(FILE_IO_WRITE, f->ebx, f->ecx, f->edx, 0);
+}
+
+static void syscall_addf(struct trap_frame *f) {
+    f->ebx = user_file_io(FILE_IO_APPEND, f->ebx, f->ecx, f->edx, 0);
+}
+
+static void syscall_seek(struct trap_frame *f) {
+    f->ebx = simplefs_seek(f->ebx, f->ecx, f->edx);
+}
+
+static void syscall_pread(struct trap_frame *f) {
+    f->ebx = user_file_io(FILE_IO_PREAD, f->ebx, f->ecx, f->edx, f->esi);
+}
+
+static void syscall_pwrite(struct trap_frame *f) {
+    f->ebx = user_file_io(FILE_IO_PWRITE, f->ebx, f->ecx, f->edx, f->esi);
+}
+
+static void syscall_sbrk(struct trap_frame *f) {
+    f->ebx = sys_sbrk(f->ebx);
+}
+
+static void syscall_fork(struct trap_frame *f) {
+    f->ebx = sys_fork(f);
+}
+
+static void syscall_exec(struct trap_frame *f) {
+    char name[SIMPLEFS_MAX_FILENAME];
+    if (copy_string_from_user(name, f->ebx, sizeof(name)) < 0 || sys_exec(f, name) < 0)
+        f->ebx = -1;
+}
+
+static void syscall_sleep(struct trap_frame *f) {
+    timer_sleep(f->ebx);
+    f->ebx = 0;
+}
+
+static void syscall_setprio(struct trap_frame *f) {
+    f->ebx = sys_setprio(f->ebx);
+}
+
+static void syscall_getpid(struct trap_frame *f) {
+    f->ebx = current_proc->pid;
+}
+
+static void syscall_ring_setup(struct trap_frame *f) {
+    f->ebx = io_ring_setup();
+}
+
+static void syscall_ring_enter(struct trap_frame *f) {
+    f->ebx = io_ring_enter(f->ebx);
+}
+
+static void syscall_mmap(struct trap_frame *f) {
+    f->ebx = sys_mmap(f->ebx, f->ecx, f->edx);
+}
+
+static void syscall_msync(struct trap_frame *f) {
+    f->ebx = sys_msync(f->ebx, f->ecx);
+}
+
+static void syscall_munmap(struct trap_frame *f) {
+    f->ebx = sys_munmap(f->ebx);
+}
+
+// Indexed by the number in eax; gaps are numbers with no handler
+static void (*const syscall_table[])(struct trap_frame *f) = {
+    [SYS_PUTCHAR] = syscall_putchar,
+    [SYS_GETCHAR] = syscall_getchar,
+    [SYS_EXIT]    = syscall_exit,
+    [SYS_READF]   = syscall_readf,
+    [SYS_ADDF]    = syscall_addf,
+    [SYS_WRITEF]  = syscall_writef,
+    [SYS_OPEN]    = syscall_open,
+    [SYS_CLOSE]   = syscall_close,
+    [SYS_SEEK]    = syscall_seek,
+    [SYS_PREAD]   = syscall_pread,
+    [SYS_PWRITE]  = syscall_pwrite,
+    [SYS_SBRK]    = syscall_sbrk,
+    [SYS_FORK]    = syscall_fork,
+    [SYS_EXEC]    = syscall_exec,
+    [SYS_SLEEP]   = syscall_sleep,
+    [SYS_SETPRIO] = syscall_setprio,
+    [SYS_GETPID]  = syscall_getpid,
+    [SYS_RING_SETUP] = syscall_ring_setup,
+    [SYS_RING_ENTER] = syscall_ring_enter,
+    [SYS_MMAP]    = syscall_mmap,
+    [SYS_MSYNC]   = syscall_msync,
+    [SYS_MUNMAP]  = syscall_munmap,
+};
+
+#define SYSCALL_COUNT (sizeof(syscall_table) / sizeof(syscall_table[0]))
+
+void handle_syscall(struct trap_frame *f) {
+    if (f->eax >= SYSCALL_COUNT || !syscall_table[f->eax])
+        PANIC("unexpected syscall eax=%x\n", f->eax);
+    syscall_table[f->eax](f);
+}
+
+// SYSENTER entry, from sysenter_entry in interrupts.s. The frame is laid
+// out as if int 0x80 had been used, so fork and exec work unchanged; the
+// stub returns with SYSEXIT to the frame's eip and user_esp.
+void handle_fast_syscall(struct trap_frame *f) {
+    handle_syscall(f);
+    if (this_cpu()->need_resched)
+        yield();
+}
+
+// Write to a page fork left shared: take a private copy, or just make it
+// writable again if no other process maps it any more
+static bool cow_fault(struct process *proc, uint32_t vaddr) {
+    uint32_t *pte = find_pte(proc->page_table, vaddr);
+    if (!pte || !(*pte & PAGE_COW))
+        return false;
+
+    paddr_t old = *pte & ~0xfff;
+    uint32_t flags = (*pte & 0xfff & ~PAGE_COW) | PAGE_WRITE;
+    if (page_refs(old) == 1) {
+        *pte = old | flags;
+    } else {
+        paddr_t page = alloc_pages(1);
+        memcpy((void *) page, (void *) old, PAGE_SIZE);
+        *pte = page | flags;
+        page_put(old);
+    }
+    invlpg(vaddr & ~(PAGE_SIZE - 1));
+    return true;
+}
+
+// Demand paging: user memory is mapped the first time it is touched.
+// Image pages are copied from the image, heap and stack pages start out
+// zeroed. Writes to pages shared by fork are handled by cow_fault().
+// Returns false if vaddr is not part of the process at all.
+static bool handle_page_fault(uint32_t vaddr, uint32_t err_code) {
+    struct process *proc = current_proc;
+    if (proc->page_table == kernel_pd || vaddr < USER_BASE)
+        return false;
+    if (err_code & PF_PRESENT)
+        return (err_code & PF_WRITE) && cow_fault(proc, vaddr);
+
+    struct mmap_area *area = find_mmap(proc, vaddr);
+    if (area)
+        return mmap_fault(proc, area, vaddr);
+
+    bool in_image = vaddr >= USER_BASE && vaddr < proc->heap_start;
+    bool in_heap = vaddr >= proc->heap_start && vaddr < align_up(proc->brk, PAGE_SIZE);
+    bool in_stack = vaddr >= USER_STACK_TOP - USER_STACK_SIZE && vaddr < USER_STACK_TOP;
+    if (!in_image && !in_heap && !in_stack)
+        return false;
+
+    uint32_t page_vaddr = vaddr & ~(PAGE_SIZE - 1);
+    paddr_t page = alloc_pages(1);
+    if (in_image) {
+        uint32_t off = page_vaddr - USER_BASE;
+        uint32_t remaining = proc->image_size - off;
+        memcpy((void *) page, proc->image + off, remaining < PAGE_SIZE ? remaining : PAGE_SIZE);
+    }
+    map_page(proc->page_table, page_vaddr, page, PAGE_USER | PAGE_WRITE);
+    return true;
+}
+
+// A fault in user mode, or in a syscall touching a bad user address, kills
+// the process. Anything else is a kernel bug.
+static void handle_exception(struct trap_frame *f) {
+    uint32_t cr2 = read_cr2();
+    bool user = (f->cs & 3) == 3;
+
+    // User memory is only touched by the copy helpers, never under the fs
+    // lock: paging in an mmap()ed file would deadlock on it, and killing
+    // the process would leave it held for good
+    if (!user && fs_lock_held())
+        PANIC("%s with the fs lock held: eip=%x, cr2=%x", exc_names[f->int_no], f->eip, cr2);
+
+    if (f->int_no == EXC_PAGE_FAULT && handle_page_fault(cr2, f->err_code))
+        return;
+
+    bool bad_user_ptr = f->int_no == EXC_PAGE_FAULT && current_proc->page_table != kernel_pd &&
+                        cr2 >= USER_BASE;
+    if (user || bad_user_ptr) {
+        printf("process %d: %s at eip=%x, err=%x", current_proc->pid,
+               exc_names[f->int_no], f->eip, f->err_code);
+        if (f->int_no == EXC_PAGE_FAULT)
+            printf(", addr=%x", cr2);
+        printf("\n");
+        exit_current();
     }
+
+    PANIC("%s in kernel: eip=%x, err=%x, cr2=%x", exc_names[f->int_no], f->eip, f->err_code, cr2);
 }
 
 void handle_interrupt(struct trap_frame *f) {
-    if (f->int_no == 128) {  // Syscall
+    if (f->int_no < EXC_COUNT) {
+        handle_exception(f);
+    } else if (f->int_no == 128) {  // Syscall
         handle_syscall(f);
+    } else if (f->int_no >= IRQ_BASE && f->int_no < IRQ_BASE + IRQ_COUNT) {
+        int irq = f->int_no - IRQ_BASE;
+        if (irq_handlers[irq])
+            irq_handlers[irq]();
+        irq_eoi(irq);
+    } else if (f->int_no == LAPIC_TIMER_VECTOR) {
+        timer_tick();
+        lapic_eoi();
+    } else if (f->int_no == LAPIC_RESCHED_VECTOR) {
+        lapic_eoi();  // need_resched is already set; an idle CPU leaves hlt
+    } else if (f->int_no == LAPIC_SPURIOUS_VECTOR) {
+        // Needs no EOI
     } else {
         PANIC("unexpected interrupt: int_no=%d, err=%d, eip=%x\n", 
               f->int_no, f->err_code, f->eip);
     }
+
+    // Preempt user code whose time slice is up. Kernel code is never
+    // preempted; it gives up the CPU by blocking or yielding.
+    if (this_cpu()->need_resched && (f->cs & 3) == 3)
+        yield();
+}
+
+static void print_processes(void) {
+    static const char *const state_names[] = { "unused", "runnable", "exited", "blocked" };
+    printf("Processes:\n");
+    printf("  pid 0 (shell): %s, priority %d, cpu %d\n", state_names[boot_proc.state],
+           boot_proc.priority, boot_proc.cpu);
+    for (int i = 0; i < PROCS_MAX; i++) {
+        struct process *proc = &procs[i];
+        if (proc->state == PROC_UNUSED)
+            continue;
+        printf("  pid %d: %s, priority %d, cpu %d, %d bytes of heap\n", proc->pid,
+               state_names[proc->state], proc->priority, proc->cpu, proc->brk - proc->heap_start);
+    }
+}
+
+// Cycles per call of each memcpy/memset implementation over a range of sizes
+static void membench(void) {
+    static uint8_t src[64 * 1024], dst[64 * 1024];
+    static const uint32_t sizes[] = { 64, 512, 4096, 64 * 1024 };
+    bool sse2 = (cpu_features & CPUID_SSE2) && (read_cr4() & CR4_OSFXSR);
+
+    printf("Cycles per call (byte / rep / sse2):\n");
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t n = sizes[i];
+        uint32_t iters = (256 * 1024) / n;
+        uint32_t cycles[6] = { 0 };
+
+        for (int v = 0; v < 6; v++) {
+            if (v % 3 == 2 && !sse2)
+                continue;
+            uint64_t start = rdtsc();
+            for (uint32_t k = 0; k < iters; k++) {
+                switch (v) {
+                    case 0: memcpy_bytes(dst, src, n); break;
+                    case 1: memcpy_rep(dst, src, n); break;
+                    case 2: memcpy_sse2(dst, src, n); break;
+                    case 3: memset_bytes(dst, 0, n); break;
+                    case 4: memset_rep(dst, 0, n); break;
+                    case 5: memset_sse2(dst, 0, n); break;
+                }
+            }
+            cycles[v] = (uint32_t) (rdtsc() - start) / iters;
+        }
+
+        printf("  %d bytes: memcpy %d / %d / %d  memset %d / %d / %d\n", n,
+               cycles[0], cycles[1], cycles[2], cycles[3], cycles[4], cycles[5]);
+    }
+    if (!sse2)
+        printf("  (no SSE2: sse2 column not measured)\n");
+}
+
+// Cycles per null system call (SYS_GETPID) through int 0x80 and through
+// SYSENTER, measured in user mode by syscall_bench (interrupts.s), which
+// prints the results itself
+static void syscallbench(void) {
+    if (!sysenter_enabled) {
+        printf("SYSENTER is not supported on this CPU\n");
+        return;
+    }
+    struct process *proc = create_process(syscall_bench_start,
+                                          syscall_bench_end - syscall_bench_start);
+    if (proc)
+        printf("Started process %d\n", proc->pid);
+    else
+        printf("Error: No free process slots\n");
 }
 
 void kernel_main(void) {
     memset(__bss, 0, (size_t) __bss_end - (size_t) __bss);
+    cpu_init();
+    gdt_init();
+    gdt_load(0);      // this_cpu() works from here on
+    sysenter_init(0);
+    acpi_init();      // Before paging: the tables are usually above the kernel's mapping
+    page_alloc_init();
+    slab_init();
+    paging_init();
+    cpu_prepare(0, 0);
     
     vga_init();       // Initialize VGA for VirtualBox
     serial_init();    // Initialize serial for QEMU
@@ -290,12 +1640,30 @@ void kernel_main(void) {
     printf("Input: Serial Console (QEMU)\n");
     printf("Output: VGA + Serial Console\n");
     
+    // The boot thread becomes a process (pid 0) so it can sleep on wait
+    // queues and be scheduled like the others
+    boot_proc.state = PROC_RUNNABLE;
+    boot_proc.priority = PRIO_DEFAULT;
+    boot_proc.page_table = kernel_pd;
+    boot_proc.on_cpu = true;
+    cpus[0].current = &boot_proc;
+    
     // Initialize interrupts
     idt_init();
+    if (lapic_init())
+        printf("Local APIC enabled\n");
+    if (ioapic_init())
+        printf("I/O APIC enabled\n");
+    timer_init();
+    serial_enable_irq();
+    smp_init();
+    if (ncpus > 1)
+        printf("SMP: %d CPUs running\n", ncpus);
     __asm__ __volatile__("sti");  // Enable interrupts
     
     // Initialize IDE disk
     ide_init();
+    bcache_init();
     printf("\n");
     
     // Try to mount filesystem, if fails, format it
@@ -315,7 +1683,10 @@ void kernel_main(void) {
         // Read command
         while (i < (int)sizeof(cmdline) - 1) {
             long ch = getchar();
-            if (ch >= 0) {
+            if (ch < 0) {
+                kernel_idle();
+            }
+            else {
                 if (ch == '\r' || ch == '\n') {
                     putchar('\n');
                     cmdline[i] = '\0';
@@ -371,7 +1742,7 @@ void kernel_main(void) {
                 int line_len = 0;
                 
                 while (line_len < 127) {
-                    long ch = getchar();
+                    long ch = getchar_blocking();
                     if (ch >= 0) {
                         if (ch == '\r' || ch == '\n') {
                             putchar('\n');
@@ -415,6 +1786,31 @@ void kernel_main(void) {
                 printf("Error: File '%s' not found\n", filename);
             }
         }
+        else if (strncmp(cmdline, "append ", 7) == 0) {
+            // append <file> <text>: adds one line without rewriting the file
+            char *filename = cmdline + 7;
+            char *text = filename;
+            while (*text && *text != ' ') {
+                text++;
+            }
+            if (*text == ' ') {
+                *text++ = '\0';
+            }
+            int len = 0;
+            while (text[len]) {
+                len++;
+            }
+            text[len++] = '\n';  // Overwrites the terminator; cmdline has room
+            
+            int fd = simplefs_open(filename, SIMPLEFS_O_CREAT);
+            int ret = fd >= 0 ? simplefs_append(fd, text, len) : fd;
+            simplefs_close(fd);
+            if (ret >= 0) {
+                printf("Appended %d bytes to '%s'\n", ret, filename);
+            } else {
+                printf("Error: Cannot append to '%s'\n", filename);
+            }
+        }
         else if (strncmp(cmdline, "rm ", 3) == 0) {
             char *filename = cmdline + 3;
             int ret = simplefs_delete(filename);
@@ -429,7 +1825,7 @@ void kernel_main(void) {
             char confirm[10];
             int j = 0;
             while (j < 9) {
-                long ch = getchar();
+                long ch = getchar_blocking();
                 if (ch >= 0) {
                     if (ch == '\r' || ch == '\n') {
                         putchar('\n');
@@ -457,6 +1853,67 @@ void kernel_main(void) {
                 printf("Format cancelled.\n");
             }
         }
+        else if (strcmp(cmdline, "sync") == 0) {
+            simplefs_sync();
+            fs_lock();
+            int ret = bcache_sync();
+            fs_unlock();
+            if (ret < 0) {
+                printf("Disk write error while flushing the buffer cache\n");
+            } else {
+                printf("Buffer cache flushed to disk\n");
+            }
+        }
+        else if (strcmp(cmdline, "defer on") == 0) {
+            simplefs_set_deferred(true);
+            printf("Metadata writes deferred until sync\n");
+        }
+        else if (strcmp(cmdline, "defer off") == 0) {
+            simplefs_set_deferred(false);
+            printf("Metadata writes are synchronous\n");
+        }
+        else if (strcmp(cmdline, "cache") == 0) {
+            bcache_print_stats();
+            page_cache_print_stats();
+        }
+        else if (strncmp(cmdline, "run ", 4) == 0) {
+            char *filename = cmdline + 4;
+            struct user_image *img = load_image(filename);
+            struct process *proc = img ? create_process(img->data, img->size) : NULL;
+            if (proc) {
+                proc->image_ref = img;
+                printf("Started process %d\n", proc->pid);
+            } else if (img) {
+                image_put(img);
+                printf("Error: No free process slots\n");
+            } else {
+                printf("Error: Cannot load '%s'\n", filename);
+            }
+        }
+        else if (strcmp(cmdline, "ps") == 0) {
+            print_processes();
+        }
+        else if (strcmp(cmdline, "uptime") == 0) {
+            timer_print_info();
+        }
+        else if (strcmp(cmdline, "cpus") == 0) {
+            smp_print_info();
+        }
+        else if (strcmp(cmdline, "lspci") == 0) {
+            pci_list();
+        }
+        else if (strcmp(cmdline, "mem") == 0) {
+            page_alloc_print_stats();
+        }
+        else if (strcmp(cmdline, "slabinfo") == 0) {
+            slab_print_stats();
+        }
+        else if (strcmp(cmdline, "membench") == 0) {
+            membench();
+        }
+        else if (strcmp(cmdline, "syscallbench") == 0) {
+            syscallbench();
+        }
         else if (strcmp(cmdline, "help") == 0) {
             printf("Available commands:\n");
             printf("  hello           - Print greeting\n");
@@ -464,12 +1921,29 @@ void kernel_main(void) {
             printf("  cat <file>      - Display file contents\n");
             printf("  create <file>   - Create new file\n");
             printf("  write <file>    - Write content to file\n");
+            printf("  append <f> <t>  - Append a line to file\n");
             printf("  rm <file>       - Delete file\n");
             printf("  format          - Format filesystem\n");
+            printf("  sync            - Flush cached disk writes\n");
+            printf("  defer on|off    - Batch metadata writes until sync\n");
+            printf("  cache           - Show buffer and page cache statistics\n");
+            printf("  run <file>      - Run file as a user program\n");
+            printf("  ps              - List processes\n");
+            printf("  uptime          - Show time since boot and the timer source\n");
+            printf("  cpus            - Show per-CPU scheduler statistics\n");
+            printf("  lspci           - List PCI devices\n");
+            printf("  mem             - Show page allocator statistics\n");
+            printf("  slabinfo        - Show slab cache statistics\n");
+            printf("  membench        - Benchmark memcpy/memset variants\n");
+            printf("  syscallbench    - Time int 0x80 against SYSENTER\n");
             printf("  help            - Show this help\n");
             printf("  exit            - Exit shell\n");
         }
         else if (strcmp(cmdline, "exit") == 0) {
+            simplefs_sync();
+            fs_lock();
+            bcache_sync();
+            fs_unlock();
             printf("Goodbye!\n");
             break;
         }
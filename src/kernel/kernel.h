@@ -1,26 +1,227 @@
 #pragma once
 #include "common.h"
 
-#define PROCS_MAX 8
+#define PROCS_MAX 64
+#define PROC_MMAPS_MAX 8   // mmap() areas per process
+#define CPUS_MAX  8
 #define PROC_UNUSED   0
 #define PROC_RUNNABLE 1
 #define PROC_EXITED   2
+#define PROC_BLOCKED  3
+
+// Scheduling priorities, 0 being the highest
+#define PRIO_LEVELS   32
+#define PRIO_DEFAULT  16
+
+#define FPU_STATE_SIZE 512   // FXSAVE image; FNSAVE needs only 108 bytes
+
+// Operations for user_file_io()
+#define FILE_IO_READ   0
+#define FILE_IO_WRITE  1
+#define FILE_IO_APPEND 2
+#define FILE_IO_PREAD  3
+#define FILE_IO_PWRITE 4
 
 // x86 paging flags
 #define PAGE_PRESENT  (1 << 0)
 #define PAGE_WRITE    (1 << 1)
 #define PAGE_USER     (1 << 2)
+#define PAGE_PWT      (1 << 3)   // Write-through
+#define PAGE_PCD      (1 << 4)   // Cache disabled (device memory)
+#define PAGE_DIRTY    (1 << 6)   // Written since the bit was cleared (set by the CPU)
+#define PAGE_PSE      (1 << 7)   // PDE maps a 4MB page
+#define PAGE_GLOBAL   (1 << 8)   // Kept in the TLB across CR3 loads
+#define PAGE_COW      (1 << 9)   // Shared by fork; copied on the first write
+#define PAGE_NOFORK   (1 << 10)  // Not inherited by a forked child (e.g. the io_ring page)
+#define PAGE_SHARED   (1 << 11)  // Shared with a forked child as is, not copy-on-write (mmap)
+
+#define LARGE_PAGE_SIZE 0x400000
+
+// User space starts above the kernel's identity-mapped low memory
+#define USER_BASE 0x40000000
+#define USER_STACK_TOP  0x80000000
+#define USER_STACK_SIZE (1024 * 1024)
+#define USER_MMAP_BASE  0x70000000   // mmap() areas, up to USER_IO_RING
+#define USER_IO_RING    (USER_STACK_TOP - USER_STACK_SIZE - PAGE_SIZE)  // Where io_ring_setup() maps the rings
+#define USER_HEAP_MAX   USER_MMAP_BASE  // brk may not reach the mappings or the stack
+#define USER_PDE_END    (USER_STACK_TOP >> 22)  // PDEs above this map devices (map_mmio)
+
+// GDT selectors (user ones include RPL 3)
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE   0x1B
+#define GDT_USER_DATA   0x23
+#define GDT_TSS         0x28   // CPU n's TSS is at GDT_TSS + 8 * n
+
+// CPU exception vectors
+#define EXC_COUNT      32
+#define EXC_PAGE_FAULT 14
+
+// Page-fault error code bits
+#define PF_PRESENT (1 << 0)   // Protection violation (else: page not present)
+#define PF_WRITE   (1 << 1)
+#define PF_USER    (1 << 2)
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_FPU  (1u << 0)
+#define CPUID_PSE  (1u << 3)
+#define CPUID_MSR  (1u << 5)
+#define CPUID_APIC (1u << 9)
+#define CPUID_SEP  (1u << 11)   // SYSENTER/SYSEXIT
+#define CPUID_PGE  (1u << 13)
+#define CPUID_FXSR (1u << 24)
+#define CPUID_SSE  (1u << 25)
+#define CPUID_SSE2 (1u << 26)
 
-#define USER_BASE 0x1000000
+// Control register bits
+#define CR0_MP         (1u << 1)
+#define CR0_EM         (1u << 2)
+#define CR0_WP         (1u << 16)  // Read-only pages are read-only for the kernel too
+#define CR4_PSE        (1u << 4)
+#define CR4_PGE        (1u << 7)
+#define CR4_OSFXSR     (1u << 9)
+#define CR4_OSXMMEXCPT (1u << 10)
+
+// Model-specific registers
+#define MSR_APIC_BASE  0x1B
+#define MSR_SYSENTER_CS  0x174   // Kernel CS; SS, and the user CS/SS for SYSEXIT, follow it in the GDT
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+// A program read from a file by exec. Processes forked after the exec
+// share it, so it is reference counted.
+struct user_image {
+    uint32_t refs;
+    uint32_t size;
+    uint8_t data[];
+};
+
+// Busy-waiting lock for state shared between CPUs
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+// A file mapped by mmap(); its pages come from the page cache
+struct mmap_area {
+    uint32_t start;              // Page aligned
+    uint32_t pages;              // 0 if the slot is free
+    int ino;
+    uint32_t gen;                // Inode generation: a reused inode is not this file
+    uint32_t first;              // File page mapped at start
+};
 
 struct process {
     int pid;
     int state;
     vaddr_t sp;
     uint32_t *page_table;
+    struct process *wait_next;   // Next sleeper on the same wait queue
+    struct process *run_next;    // Next in the same run queue
+    uint32_t priority;
+    uint32_t cpu;                // Run queue it goes back to when woken
+    volatile bool on_cpu;        // Running, or still being switched away from
+    struct spinlock lock;        // Guards state against concurrent wake-ups
+    // User address space. Image pages are copied in and heap/stack pages
+    // zero-filled when first touched.
+    const uint8_t *image;
+    uint32_t image_size;
+    uint32_t heap_start;
+    uint32_t brk;                // End of the heap
+    struct user_image *image_ref;  // Owner of image when loaded by exec
+    uint32_t wake_tick;          // When a sleeping process is due (timer_sleep)
+    struct io_ring *io_ring;     // Its ring page (see io_ring.h), or NULL
+    struct mmap_area mmaps[PROC_MMAPS_MAX];
+    uint8_t bounce[PAGE_SIZE];   // Kernel copy of user data for file I/O
+    uint8_t fpu[FPU_STATE_SIZE] __attribute__((aligned(16)));  // x87/SSE registers while switched out
     uint8_t stack[8192];
 };
 
+// Processes blocked until an event (e.g. a disk interrupt) wakes them
+struct wait_queue {
+    struct spinlock lock;
+    struct process *head;
+};
+
+// Sleeping lock for state used across disk I/O: waiters block instead
+// of spinning
+struct mutex {
+    struct process *owner;       // NULL when free
+    struct wait_queue wq;        // Its lock also guards owner
+};
+
+struct tss {
+    uint32_t prev_tss;
+    uint32_t esp0;               // Kernel stack for user -> kernel transitions
+    uint32_t ss0;
+    uint32_t unused[22];         // Hardware task switching state, not used
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// Per-CPU state. Each CPU has its own TSS, so the task register tells
+// which entry belongs to the running CPU (see this_cpu).
+struct cpu {
+    uint32_t id;                 // Index in cpus[]
+    uint32_t apic_id;
+    struct process *current;
+    struct process *idle;        // Runs when there is nothing else to do
+    struct process *prev;        // Switched away from, until finish_switch()
+    struct tss tss;
+    // Run queue: a FIFO per priority and a bitmap of the non-empty ones
+    struct spinlock rq_lock;
+    struct process *rq_head[PRIO_LEVELS];
+    struct process *rq_tail[PRIO_LEVELS];
+    uint32_t rq_bitmap;
+    uint32_t rq_count;
+    int slice_left;              // Ticks left in the current time slice
+    volatile bool need_resched;
+    volatile bool started;
+    // Statistics
+    uint32_t switches;
+    uint32_t steals;             // Processes taken from other CPUs' queues
+    uint32_t busy_ticks;
+    uint32_t idle_ticks;
+};
+
+// Hardware IRQ lines (PIC remapped to vectors 0x20-0x2F)
+#define IRQ_BASE    32
+#define IRQ_COUNT   16
+#define IRQ_CASCADE 2
+#define IRQ_IDE0    14
+
+extern struct cpu cpus[CPUS_MAX];
+extern uint32_t ncpus;           // CPUs running the scheduler
+extern uint32_t cpu_features;    // CPUID leaf 1 EDX
+extern uint32_t *kernel_pd;      // Kernel page directory
+extern uint32_t kernel_pdes;     // PDEs shared by every page directory
+
+void yield(void);
+void finish_switch(void);
+void sleep_on(struct wait_queue *wq);
+void sleep_on_locked(struct wait_queue *wq);
+void wake_up(struct wait_queue *wq);
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+void fs_lock(void);
+void fs_unlock(void);
+bool fs_lock_held(void);
+int current_pid(void);
+void cpu_prepare(uint32_t index, uint32_t apic_id);
+void ap_main(uint32_t index);
+void scheduler_tick(void);
+void console_flush(void);
+void console_write(const char *s, size_t n);
+void map_mmio(paddr_t paddr);
+void map_page(uint32_t *page_dir, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+bool user_range_ok(uint32_t addr, uint32_t len);
+int copy_from_user(void *dst, uint32_t src, size_t len);
+int copy_to_user(uint32_t dst, const void *src, size_t len);
+int copy_string_from_user(char *dst, uint32_t src, size_t size);
+int user_file_io(int op, int fd, uint32_t addr, uint32_t len, uint32_t off);
+void idt_set_gate(uint8_t num, uint32_t handler, uint16_t sel, uint8_t flags);
+void irq_register(int irq, void (*handler)(void));
+void irq_unmask(int irq);
+
 struct trap_frame {
     uint32_t edi;
     uint32_t esi;
@@ -43,6 +244,7 @@ struct trap_frame {
 #define PANIC(fmt, ...)                                                        \
     do {                                                                       \
         printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);  \
+        console_flush();                                                       \
         while (1) { __asm__ __volatile__("hlt"); }                             \
     } while (0)
 
@@ -69,6 +271,53 @@ static inline void sti(void) {
     __asm__ __volatile__("sti");
 }
 
+// Disable interrupts, returning the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf\n popl %0\n cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0\n popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline void cpu_relax(void) {
+    __asm__ __volatile__("pause" : : : "memory");
+}
+
+static inline void spin_lock(struct spinlock *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked)
+            cpu_relax();
+    }
+}
+
+static inline void spin_unlock(struct spinlock *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// Also keeps this CPU's interrupt handlers away from the lock
+static inline uint32_t spin_lock_irqsave(struct spinlock *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+// The running CPU, from its task register
+static inline struct cpu *this_cpu(void) {
+    uint16_t tr;
+    __asm__ __volatile__("str %0" : "=r"(tr));
+    return &cpus[(tr - GDT_TSS) / 8];
+}
+
+#define current_proc (this_cpu()->current)
+
 static inline void load_idt(void *idt_ptr) {
     __asm__ __volatile__("lidt (%0)" : : "r"(idt_ptr));
 }
@@ -77,12 +326,62 @@ static inline void load_cr3(uint32_t pd) {
     __asm__ __volatile__("mov %0, %%cr3" : : "r"(pd));
 }
 
+static inline uint32_t read_cr2(void) {
+    uint32_t value;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline void invlpg(uint32_t vaddr) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
 static inline uint32_t read_cr3(void) {
     uint32_t value;
     __asm__ __volatile__("mov %%cr3, %0" : "=r"(value));
     return value;
 }
 
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t value;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(value));
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t value;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(value));
+}
+
 static inline void enable_paging(void) {
     uint32_t cr0;
     __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
@@ -0,0 +1,258 @@
+#include "page_alloc.h"
+#include "common.h"
+#include "kernel.h"
+
+extern char __free_ram[], __free_ram_end[];
+
+// Per-frame flags
+#define PG_FREE 0x01   // Page is part of a free block
+#define PG_HEAD 0x02   // First page of a free block (order and links valid)
+#define PG_ZERO 0x04   // Page is known to contain only zeros
+
+#define PFN_NONE 0xFFFF
+
+struct page_frame {
+    uint8_t flags;
+    uint8_t order;
+    uint16_t next;     // Free list links, heads only
+    uint16_t prev;
+    uint16_t refs;     // Page table entries mapping the page (see page_get)
+    void *owner;       // Set by the allocated pages' user (e.g. the slab allocator)
+};
+
+static struct page_frame frames[PAGE_FRAMES_MAX];
+static uint16_t free_list[PAGE_MAX_ORDER + 1];
+static paddr_t ram_base;
+static uint32_t nframes;
+static uint32_t zero_cursor;   // Where page_zero_idle() resumes its scan
+static struct page_stats stats;
+static struct spinlock page_lock;   // Free lists, frame flags/refs and stats
+
+static inline void *frame_addr(uint32_t pfn) {
+    return (void *) (ram_base + pfn * PAGE_SIZE);
+}
+
+static void list_add(uint32_t order, uint32_t pfn) {
+    struct page_frame *f = &frames[pfn];
+    f->flags |= PG_HEAD;
+    f->order = order;
+    f->prev = PFN_NONE;
+    f->next = free_list[order];
+    if (f->next != PFN_NONE)
+        frames[f->next].prev = pfn;
+    free_list[order] = pfn;
+}
+
+static void list_del(uint32_t order, uint32_t pfn) {
+    struct page_frame *f = &frames[pfn];
+    if (f->prev != PFN_NONE)
+        frames[f->prev].next = f->next;
+    else
+        free_list[order] = f->next;
+    if (f->next != PFN_NONE)
+        frames[f->next].prev = f->prev;
+    f->flags &= ~PG_HEAD;
+}
+
+// Put a free block back, merging with its buddy for as long as the buddy
+// is a free block of the same order
+static void free_block(uint32_t pfn, uint32_t order) {
+    while (order < PAGE_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy + (1u << order) > nframes || !(frames[buddy].flags & PG_HEAD) ||
+            frames[buddy].order != order)
+            break;
+        list_del(order, buddy);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    list_add(order, pfn);
+}
+
+// Return n pages starting at pfn as the largest aligned blocks that fit
+static void free_range(uint32_t pfn, uint32_t n) {
+    while (n > 0) {
+        uint32_t order = PAGE_MAX_ORDER;
+        while ((pfn & ((1u << order) - 1)) || (1u << order) > n)
+            order--;
+        free_block(pfn, order);
+        pfn += 1u << order;
+        n -= 1u << order;
+    }
+}
+
+void page_alloc_init(void) {
+    ram_base = align_up((paddr_t) __free_ram, PAGE_SIZE);
+    nframes = ((paddr_t) __free_ram_end - ram_base) / PAGE_SIZE;
+    if (nframes > PAGE_FRAMES_MAX)
+        nframes = PAGE_FRAMES_MAX;
+
+    for (int i = 0; i <= PAGE_MAX_ORDER; i++)
+        free_list[i] = PFN_NONE;
+
+    // Contents are unknown; page_zero_idle() clears them over time
+    for (uint32_t i = 0; i < nframes; i++)
+        frames[i].flags = PG_FREE;
+    free_range(0, nframes);
+
+    stats.total = nframes;
+    stats.free = nframes;
+    stats.dirty_free = nframes;
+}
+
+// Allocate n contiguous zeroed pages. The request is served from a block
+// of the next power of two; pages past n go straight back to the free
+// lists. Pages already cleared by page_zero_idle() are not cleared again.
+paddr_t alloc_pages(uint32_t n) {
+    uint32_t order = 0;
+    while ((1u << order) < n)
+        order++;
+    if (order > PAGE_MAX_ORDER)
+        PANIC("alloc_pages: %d pages is too many", n);
+
+    uint32_t flags = spin_lock_irqsave(&page_lock);
+
+    uint32_t k = order;
+    while (k <= PAGE_MAX_ORDER && free_list[k] == PFN_NONE)
+        k++;
+    if (k > PAGE_MAX_ORDER)
+        PANIC("out of memory");
+
+    uint32_t pfn = free_list[k];
+    list_del(k, pfn);
+    while (k > order) {
+        k--;
+        list_add(k, pfn + (1u << k));   // Upper half of the split
+    }
+    if ((1u << order) > n)
+        free_range(pfn + n, (1u << order) - n);
+
+    uint32_t dirty = 0;
+    for (uint32_t i = pfn; i < pfn + n; i++) {
+        frames[i].flags &= ~PG_FREE;
+        if (!(frames[i].flags & PG_ZERO))
+            dirty++;
+    }
+    stats.free -= n;
+    stats.dirty_free -= dirty;
+    stats.zeroed_on_alloc += dirty;
+    stats.allocs++;
+
+    spin_unlock_irqrestore(&page_lock, flags);
+
+    for (uint32_t i = pfn; i < pfn + n; i++) {
+        if (!(frames[i].flags & PG_ZERO))
+            memset(frame_addr(i), 0, PAGE_SIZE);
+        frames[i].flags &= ~PG_ZERO;
+        frames[i].refs = 1;
+        frames[i].owner = NULL;
+    }
+    return (paddr_t) frame_addr(pfn);
+}
+
+static struct page_frame *frame_of(paddr_t paddr) {
+    uint32_t pfn = (paddr - ram_base) / PAGE_SIZE;
+    if (paddr < ram_base || pfn >= nframes)
+        PANIC("address %x is not in managed RAM", paddr);
+    return &frames[pfn];
+}
+
+// Tag an allocated page so its owner can be found from any address in it
+void page_set_owner(paddr_t paddr, void *owner) {
+    frame_of(paddr)->owner = owner;
+}
+
+void *page_owner(paddr_t paddr) {
+    return frame_of(paddr)->owner;
+}
+
+// Reference counts for user pages, which fork shares between address
+// spaces. alloc_pages() hands each page out with one reference.
+void page_get(paddr_t paddr) {
+    uint32_t flags = spin_lock_irqsave(&page_lock);
+    frame_of(paddr)->refs++;
+    spin_unlock_irqrestore(&page_lock, flags);
+}
+
+// Drop a reference; the last one frees the page. Returns the references left.
+uint32_t page_put(paddr_t paddr) {
+    uint32_t flags = spin_lock_irqsave(&page_lock);
+    struct page_frame *f = frame_of(paddr);
+    if (f->refs == 0)
+        PANIC("page_put: %x has no references", paddr);
+    uint32_t refs = --f->refs;
+    spin_unlock_irqrestore(&page_lock, flags);
+
+    if (refs == 0)
+        free_pages(paddr, 1);
+    return refs;
+}
+
+uint32_t page_refs(paddr_t paddr) {
+    return frame_of(paddr)->refs;
+}
+
+void free_pages(paddr_t paddr, uint32_t n) {
+    if (paddr < ram_base || !is_aligned(paddr, PAGE_SIZE))
+        PANIC("free_pages: bad address %x", paddr);
+
+    uint32_t pfn = (paddr - ram_base) / PAGE_SIZE;
+    if (pfn + n > nframes)
+        PANIC("free_pages: bad range %x + %d", paddr, n);
+
+    uint32_t flags = spin_lock_irqsave(&page_lock);
+
+    for (uint32_t i = pfn; i < pfn + n; i++) {
+        if (frames[i].flags & PG_FREE)
+            PANIC("free_pages: double free of %x", (paddr_t) frame_addr(i));
+        frames[i].flags = PG_FREE;
+        frames[i].refs = 0;
+    }
+    free_range(pfn, n);
+    stats.free += n;
+    stats.dirty_free += n;
+    stats.frees++;
+
+    spin_unlock_irqrestore(&page_lock, flags);
+}
+
+// Clear up to budget free pages ahead of time, so later allocations get
+// them without paying for memset. Called when the CPU has nothing to do.
+// Returns the number of pages cleared.
+uint32_t page_zero_idle(uint32_t budget) {
+    uint32_t zeroed = 0;
+    while (zeroed < budget && stats.dirty_free > 0) {
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+
+        struct page_frame *f = &frames[zero_cursor];
+        if ((f->flags & (PG_FREE | PG_ZERO)) == PG_FREE) {
+            memset(frame_addr(zero_cursor), 0, PAGE_SIZE);
+            f->flags |= PG_ZERO;
+            stats.dirty_free--;
+            stats.zeroed_idle++;
+            zeroed++;
+        }
+        if (++zero_cursor == nframes)
+            zero_cursor = 0;
+
+        spin_unlock_irqrestore(&page_lock, flags);
+    }
+    return zeroed;
+}
+
+void page_alloc_print_stats(void) {
+    printf("Pages: %d total, %d free (%d not yet zeroed)\n",
+           stats.total, stats.free, stats.dirty_free);
+    printf("  Allocs: %d  Frees: %d\n", stats.allocs, stats.frees);
+    printf("  Zeroed on alloc: %d  Zeroed while idle: %d\n",
+           stats.zeroed_on_alloc, stats.zeroed_idle);
+
+    printf("  Free blocks by order:");
+    for (int order = 0; order <= PAGE_MAX_ORDER; order++) {
+        int count = 0;
+        for (uint32_t pfn = free_list[order]; pfn != PFN_NONE; pfn = frames[pfn].next)
+            count++;
+        printf(" %d", count);
+    }
+    printf("\n");
+}
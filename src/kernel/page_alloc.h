@@ -0,0 +1,28 @@
+#pragma once
+#include "common.h"
+
+// Buddy allocator for the physical page frames in __free_ram
+
+#define PAGE_MAX_ORDER   10                            // Largest block: 2^10 pages (4MB)
+#define PAGE_FRAMES_MAX  (64 * 1024 * 1024 / PAGE_SIZE) // Size of __free_ram in pages
+
+struct page_stats {
+    uint32_t total;              // Pages managed
+    uint32_t free;               // Pages on the free lists
+    uint32_t dirty_free;         // Free pages not yet zeroed
+    uint32_t allocs;             // alloc_pages() calls
+    uint32_t frees;              // free_pages() calls
+    uint32_t zeroed_on_alloc;    // Pages alloc_pages() had to clear itself
+    uint32_t zeroed_idle;        // Pages cleared ahead of time by page_zero_idle()
+};
+
+void page_alloc_init(void);
+paddr_t alloc_pages(uint32_t n);
+void free_pages(paddr_t paddr, uint32_t n);
+void page_set_owner(paddr_t paddr, void *owner);
+void *page_owner(paddr_t paddr);
+void page_get(paddr_t paddr);
+uint32_t page_put(paddr_t paddr);
+uint32_t page_refs(paddr_t paddr);
+uint32_t page_zero_idle(uint32_t budget);
+void page_alloc_print_stats(void);
@@ -0,0 +1,168 @@
+#include "page_cache.h"
+#include "common.h"
+#include "kernel.h"
+#include "page_alloc.h"
+#include "slab.h"
+#include "simplefs.h"
+
+struct cached_page {
+    struct cached_page *next;    // Same hash bucket
+    int ino;
+    uint32_t gen;                // Inode generation (see simplefs_fd_ino)
+    uint32_t index;
+    paddr_t page;
+};
+
+static struct cached_page *buckets[PAGE_CACHE_BUCKETS];
+static struct spinlock cache_lock;   // Bucket lists and statistics
+static uint32_t cached, hits, misses, writebacks;
+
+static inline uint32_t bucket_of(int ino, uint32_t index) {
+    return (ino * 31 + index) % PAGE_CACHE_BUCKETS;
+}
+
+// Caller holds cache_lock
+static struct cached_page *cache_find(int ino, uint32_t gen, uint32_t index) {
+    for (struct cached_page *cp = buckets[bucket_of(ino, index)]; cp; cp = cp->next) {
+        if (cp->ino == ino && cp->gen == gen && cp->index == index)
+            return cp;
+    }
+    return NULL;
+}
+
+// The cached copy of a page, with a reference for the caller, or 0
+static paddr_t cache_lookup_get(int ino, uint32_t gen, uint32_t index) {
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    struct cached_page *cp = cache_find(ino, gen, index);
+    paddr_t page = 0;
+    if (cp) {
+        page = cp->page;
+        page_get(page);
+        hits++;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    return page;
+}
+
+// Page index of a file, read in on a miss, with a reference for the
+// caller to map. Returns 0 if the page lies wholly past the end of the
+// file or the file is gone: deleted, or its inode reused since gen.
+// Only user page faults come here, never with the fs lock held.
+paddr_t page_cache_get(int ino, uint32_t gen, uint32_t index) {
+    paddr_t page = cache_lookup_get(ino, gen, index);
+    if (page)
+        return page;
+
+    fs_lock();
+
+    // Someone may have read it in while we waited for the lock
+    page = cache_lookup_get(ino, gen, index);
+    if (!page) {
+        paddr_t fresh = alloc_pages(1);   // Zeroed, so the tail past EOF reads as zeros
+        if (simplefs_ino_pread_locked(ino, gen, (void *) fresh, PAGE_SIZE, index * PAGE_SIZE) > 0) {
+            struct cached_page *cp = kmalloc(sizeof(*cp));
+            cp->ino = ino;
+            cp->gen = gen;
+            cp->index = index;
+            cp->page = fresh;             // The cache keeps alloc_pages()'s reference
+            page_get(fresh);
+            page = fresh;
+
+            uint32_t flags = spin_lock_irqsave(&cache_lock);
+            uint32_t b = bucket_of(ino, index);
+            cp->next = buckets[b];
+            buckets[b] = cp;
+            cached++;
+            misses++;
+            spin_unlock_irqrestore(&cache_lock, flags);
+        } else {
+            free_pages(fresh, 1);
+        }
+    }
+
+    fs_unlock();
+    return page;
+}
+
+// Write a mapped page back to its file. Only the part inside the file is
+// written. A page dropped from the cache since it was mapped belongs to
+// no file any more and is skipped.
+void page_cache_writeback(int ino, uint32_t gen, uint32_t index, paddr_t page) {
+    fs_lock();
+
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    struct cached_page *cp = cache_find(ino, gen, index);
+    bool current = cp && cp->page == page;
+    if (current)
+        writebacks++;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    if (current)
+        simplefs_ino_pwrite_locked(ino, gen, (const void *) page, PAGE_SIZE, index * PAGE_SIZE);
+
+    fs_unlock();
+}
+
+// Drop every cached page of a file whose contents are going away, of any
+// generation. Pages still mapped stay with their mappers, no longer tied
+// to the file. Called by the file system with the fs lock held.
+void page_cache_invalidate(int ino) {
+    struct cached_page *dropped = NULL;
+
+    uint32_t flags = spin_lock_irqsave(&cache_lock);
+    for (int b = 0; b < PAGE_CACHE_BUCKETS; b++) {
+        struct cached_page **link = &buckets[b];
+        while (*link) {
+            struct cached_page *cp = *link;
+            if (cp->ino == ino) {
+                *link = cp->next;
+                cp->next = dropped;
+                dropped = cp;
+                cached--;
+            } else {
+                link = &cp->next;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    while (dropped) {
+        struct cached_page *cp = dropped;
+        dropped = cp->next;
+        page_put(cp->page);
+        kfree(cp);
+    }
+}
+
+// Copy data just written to a file through a descriptor into any cached
+// pages it covers, so mappers see it. Called by the file system with the
+// fs lock held, which keeps the pages from being dropped meanwhile; buf
+// is kernel memory (user data arrives through a bounce buffer), so the
+// copy can't fault. Only the current generation can have cached pages.
+void page_cache_update(int ino, uint32_t off, const void *buf, size_t len) {
+    uint32_t gen = fs.generation[ino];
+    const uint8_t *src = buf;
+    while (len > 0) {
+        uint32_t index = off / PAGE_SIZE;
+        uint32_t in_page = off % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - in_page;
+        if (chunk > len)
+            chunk = len;
+
+        uint32_t flags = spin_lock_irqsave(&cache_lock);
+        struct cached_page *cp = cache_find(ino, gen, index);
+        paddr_t page = cp ? cp->page : 0;
+        spin_unlock_irqrestore(&cache_lock, flags);
+        if (page)
+            memcpy((uint8_t *) page + in_page, src, chunk);
+
+        src += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+}
+
+void page_cache_print_stats(void) {
+    printf("Page cache: %d pages, %d hits, %d misses, %d writebacks\n",
+           cached, hits, misses, writebacks);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "common.h"
+
+// Cache of file pages for mmap(), keyed by inode number, inode generation
+// and page index.
+// Every process mapping a page maps the same physical copy, so their
+// writes are shared; they reach the disk when a mapper calls msync or
+// munmap, or exits. A cached page holds one reference of its own (see
+// page_get), so it outlives its mappings. The disk is small enough for
+// every page of it to be cached, so nothing is evicted; pages are dropped
+// only when their file is truncated, replaced or deleted.
+
+#define PAGE_CACHE_BUCKETS 64
+
+paddr_t page_cache_get(int ino, uint32_t gen, uint32_t index);
+void page_cache_writeback(int ino, uint32_t gen, uint32_t index, paddr_t page);
+void page_cache_invalidate(int ino);
+void page_cache_update(int ino, uint32_t off, const void *buf, size_t len);
+void page_cache_print_stats(void);
@@ -0,0 +1,219 @@
+#include "slab.h"
+#include "common.h"
+#include "kernel.h"
+#include "page_alloc.h"
+
+// Slab header, in the first cache line of the slab. Objects follow it.
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free;                  // Free objects, linked through their first word
+    uint32_t inuse;
+};
+
+_Static_assert(sizeof(struct slab) <= CACHE_LINE, "slab header must fit in a cache line");
+
+// kmalloc blocks above KMALLOC_MAX are whole pages; their owner tag holds
+// the page count with the low bit set, which no slab pointer has
+#define LARGE_TAG(pages)   ((void *) (((pages) << 1) | 1))
+#define IS_LARGE_TAG(tag)  ((uint32_t) (tag) & 1)
+#define LARGE_PAGES(tag)   ((uint32_t) (tag) >> 1)
+
+#define KMALLOC_CACHES 8             // 16, 32, ... 2048 bytes
+
+static struct kmem_cache caches[SLAB_MAX_CACHES];
+static uint32_t ncaches;
+static struct kmem_cache *kmalloc_caches[KMALLOC_CACHES];
+static const char *kmalloc_names[KMALLOC_CACHES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+static uint32_t large_pages;         // Pages held by large kmalloc blocks
+static struct spinlock slab_lock;    // All caches' slab lists and counters
+
+static void slab_list_add(struct slab **list, struct slab *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+static void slab_list_del(struct slab **list, struct slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+// Carve a fresh slab into objects
+static struct slab *slab_grow(struct kmem_cache *cache) {
+    uint32_t pages = 1u << cache->order;
+    paddr_t base = alloc_pages(pages);
+    struct slab *s = (struct slab *) base;
+
+    for (uint32_t i = 0; i < pages; i++)
+        page_set_owner(base + i * PAGE_SIZE, s);
+
+    s->cache = cache;
+    s->inuse = 0;
+    s->free = NULL;
+    uint8_t *obj = (uint8_t *) base + CACHE_LINE + (cache->per_slab - 1) * cache->size;
+    for (uint32_t i = 0; i < cache->per_slab; i++, obj -= cache->size) {
+        *(void **) obj = s->free;
+        s->free = obj;
+    }
+
+    cache->slabs++;
+    return s;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size) {
+    if (ncaches == SLAB_MAX_CACHES)
+        PANIC("too many slab caches");
+
+    struct kmem_cache *cache = &caches[ncaches++];
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->obj_size = size;
+
+    // Small objects are padded to a power of two, which divides a cache
+    // line; anything bigger starts on a cache line boundary
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    if (size < CACHE_LINE) {
+        uint32_t pow = KMALLOC_MIN;
+        while (pow < size)
+            pow <<= 1;
+        cache->size = pow;
+    } else {
+        cache->size = align_up(size, CACHE_LINE);
+    }
+
+    // Smallest slab that wastes no more than an eighth of itself
+    for (cache->order = 0; cache->order < SLAB_MAX_ORDER; cache->order++) {
+        uint32_t bytes = (PAGE_SIZE << cache->order) - CACHE_LINE;
+        uint32_t waste = bytes % cache->size;
+        if (bytes >= cache->size && waste * 8 <= bytes + CACHE_LINE)
+            break;
+    }
+    cache->per_slab = ((PAGE_SIZE << cache->order) - CACHE_LINE) / cache->size;
+    if (cache->per_slab == 0)
+        PANIC("slab cache %s: objects of %d bytes are too large", name, size);
+    return cache;
+}
+
+// Objects are recycled as they were freed; there are no constructors and
+// nothing is cleared (see kzalloc)
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    uint32_t flags = spin_lock_irqsave(&slab_lock);
+
+    struct slab *s = cache->partial;
+    if (!s) {
+        s = cache->empty;
+        if (s)
+            slab_list_del(&cache->empty, s);
+        else
+            s = slab_grow(cache);
+        slab_list_add(&cache->partial, s);
+    }
+
+    void *obj = s->free;
+    s->free = *(void **) obj;
+    s->inuse++;
+    if (!s->free) {
+        slab_list_del(&cache->partial, s);
+        slab_list_add(&cache->full, s);
+    }
+
+    cache->active++;
+    cache->allocs++;
+    spin_unlock_irqrestore(&slab_lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    uint32_t flags = spin_lock_irqsave(&slab_lock);
+
+    struct slab *s = page_owner((paddr_t) obj);
+    if (!s || IS_LARGE_TAG(s) || s->cache != cache)
+        PANIC("kmem_cache_free: %x does not belong to %s", (uint32_t) obj, cache->name);
+
+    if (s->inuse == cache->per_slab) {
+        slab_list_del(&cache->full, s);
+        slab_list_add(&cache->partial, s);
+    }
+    *(void **) obj = s->free;
+    s->free = obj;
+    s->inuse--;
+
+    // Keep one empty slab per cache; return any others to the page allocator
+    if (s->inuse == 0) {
+        slab_list_del(&cache->partial, s);
+        if (cache->empty) {
+            free_pages((paddr_t) s, 1u << cache->order);
+            cache->slabs--;
+        } else {
+            slab_list_add(&cache->empty, s);
+        }
+    }
+
+    cache->active--;
+    cache->frees++;
+    spin_unlock_irqrestore(&slab_lock, flags);
+}
+
+void slab_init(void) {
+    for (int i = 0; i < KMALLOC_CACHES; i++)
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN << i);
+}
+
+void *kmalloc(size_t size) {
+    if (size > KMALLOC_MAX) {
+        uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        paddr_t p = alloc_pages(pages);
+        page_set_owner(p, LARGE_TAG(pages));
+        __atomic_add_fetch(&large_pages, pages, __ATOMIC_RELAXED);
+        return (void *) p;
+    }
+
+    int i = 0;
+    while ((uint32_t) (KMALLOC_MIN << i) < size)
+        i++;
+    return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void *kzalloc(size_t size) {
+    void *p = kmalloc(size);
+    memset(p, 0, size);
+    return p;
+}
+
+void kfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    void *owner = page_owner((paddr_t) ptr);
+    if (IS_LARGE_TAG(owner)) {
+        __atomic_sub_fetch(&large_pages, LARGE_PAGES(owner), __ATOMIC_RELAXED);
+        free_pages((paddr_t) ptr, LARGE_PAGES(owner));
+        return;
+    }
+    if (!owner)
+        PANIC("kfree: %x was not allocated by kmalloc", (uint32_t) ptr);
+    kmem_cache_free(((struct slab *) owner)->cache, ptr);
+}
+
+void slab_print_stats(void) {
+    printf("Slab caches:\n");
+    for (uint32_t i = 0; i < ncaches; i++) {
+        struct kmem_cache *c = &caches[i];
+        printf("  %s: %d/%d objects of %d bytes, %d slabs of %d pages, %d allocs, %d frees\n",
+               c->name, c->active, c->slabs * c->per_slab, c->size,
+               c->slabs, 1 << c->order, c->allocs, c->frees);
+    }
+    printf("  Large kmalloc blocks: %d pages\n", large_pages);
+}
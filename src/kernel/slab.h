@@ -0,0 +1,38 @@
+#pragma once
+#include "common.h"
+
+// Slab allocator: caches of same-sized objects carved out of page
+// blocks, and kmalloc/kfree on top of a set of power-of-two caches
+
+#define CACHE_LINE        64
+#define SLAB_MAX_CACHES   24
+#define SLAB_MAX_ORDER    3      // Slabs are at most 2^3 pages
+#define KMALLOC_MIN       16
+#define KMALLOC_MAX       2048   // Larger requests get whole pages
+
+struct slab;
+
+struct kmem_cache {
+    const char *name;
+    uint32_t obj_size;           // Requested size
+    uint32_t size;               // Stride: rounded up so objects never straddle cache lines
+    uint32_t order;              // Slab = 2^order pages
+    uint32_t per_slab;           // Objects per slab
+    struct slab *partial;        // Slabs with free and used objects
+    struct slab *full;           // No free objects
+    struct slab *empty;          // Kept around to absorb alloc/free churn
+    // Statistics
+    uint32_t active;             // Objects handed out
+    uint32_t slabs;              // Slabs owned
+    uint32_t allocs;
+    uint32_t frees;
+};
+
+void slab_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+void slab_print_stats(void);
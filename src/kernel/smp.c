@@ -0,0 +1,66 @@
+#include "smp.h"
+#include "common.h"
+#include "kernel.h"
+#include "acpi.h"
+#include "apic.h"
+#include "timer.h"
+
+extern char ap_trampoline[], ap_trampoline_end[], ap_boot_params[];
+
+// Start one AP with the INIT-SIPI-SIPI sequence and wait for it to reach
+// the scheduler. The second start-up IPI is only needed if the first one
+// was missed.
+static bool start_ap(uint32_t index, struct ap_boot_params *params) {
+    struct cpu *cpu = &cpus[index];
+    params->cr0 = read_cr0();
+    params->cr3 = (uint32_t) kernel_pd;
+    params->cr4 = read_cr4();
+    params->stack = (uint32_t) &cpu->idle->stack[sizeof(cpu->idle->stack)];
+    params->entry = (uint32_t) ap_main;
+    params->index = index;
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    timer_udelay(10000);
+    for (int i = 0; i < 2 && !cpu->started; i++) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        timer_udelay(200);
+    }
+
+    for (int ms = 0; ms < AP_START_TIMEOUT_MS && !cpu->started; ms++)
+        timer_udelay(1000);
+    return cpu->started;
+}
+
+// Bring up the other CPUs the MADT lists, one at a time since they share
+// the trampoline's parameter block. Call after the boot CPU's local APIC
+// and timer are set up, with interrupts disabled.
+void smp_init(void) {
+    cpus[0].apic_id = lapic_available() ? lapic_id() : 0;
+    if (!lapic_available() || acpi.ncpus < 2)
+        return;
+
+    memcpy((void *) AP_TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    struct ap_boot_params *params =
+        (struct ap_boot_params *) (AP_TRAMPOLINE + (ap_boot_params - ap_trampoline));
+
+    for (uint32_t i = 0; i < acpi.ncpus; i++) {
+        if (acpi.apic_ids[i] == cpus[0].apic_id)
+            continue;
+        uint32_t index = ncpus;
+        cpu_prepare(index, acpi.apic_ids[i]);
+        if (start_ap(index, params))
+            ncpus++;
+        else
+            printf("CPU with APIC ID %d did not start\n", acpi.apic_ids[i]);
+    }
+}
+
+void smp_print_info(void) {
+    printf("CPUs: %d running\n", ncpus);
+    for (uint32_t i = 0; i < ncpus; i++) {
+        struct cpu *cpu = &cpus[i];
+        printf("  cpu %d (APIC ID %d): %d queued, %d switches, %d steals, %d busy / %d idle ticks\n",
+               i, cpu->apic_id, cpu->rq_count, cpu->switches, cpu->steals,
+               cpu->busy_ticks, cpu->idle_ticks);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "common.h"
+
+// Multiprocessor start-up: application processors begin in real mode at
+// AP_TRAMPOLINE (see ap_trampoline in boot.s), which must be page aligned
+// and below 1MB
+
+#define AP_TRAMPOLINE 0x8000
+#define AP_START_TIMEOUT_MS 100
+
+// Read by the trampoline; filled in by smp_init() for each AP in turn
+struct ap_boot_params {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;              // Initial kernel stack
+    uint32_t entry;              // Called with the CPU index as argument
+    uint32_t index;
+};
+
+void smp_init(void);
+void smp_print_info(void);